@@ -0,0 +1,123 @@
+#include "config.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#include "AsyncIO.h"
+
+AsyncIO::~AsyncIO()
+{
+    if (sqe_ptr) munmap(sqe_ptr, sqe_size);
+    if (cq_ptr && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+    if (sq_ptr) munmap(sq_ptr, sq_size);
+    if (ring_fd >= 0) close(ring_fd);
+}
+
+std::unique_ptr<AsyncIO> AsyncIO::create(unsigned n)
+{
+    auto aio = std::make_unique<AsyncIO>();
+    if (!aio->init(n)) {
+        return nullptr;
+    }
+    return aio;
+}
+
+bool AsyncIO::init(unsigned n)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, n, &p);
+    if (ring_fd < 0) {
+        return false;
+    }
+    entries = p.sq_entries;
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = std::max(sq_size, cq_size);
+    }
+    sq_ptr = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        sq_ptr = nullptr;
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            cq_ptr = nullptr;
+            return false;
+        }
+    }
+    sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqe_ptr = mmap(0, sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqe_ptr == MAP_FAILED) {
+        sqe_ptr = nullptr;
+        return false;
+    }
+
+    sq_head = (unsigned *) ((char *) sq_ptr + p.sq_off.head);
+    sq_tail = (unsigned *) ((char *) sq_ptr + p.sq_off.tail);
+    sq_mask = (unsigned *) ((char *) sq_ptr + p.sq_off.ring_mask);
+    sq_array = (unsigned *) ((char *) sq_ptr + p.sq_off.array);
+    cq_head = (unsigned *) ((char *) cq_ptr + p.cq_off.head);
+    cq_tail = (unsigned *) ((char *) cq_ptr + p.cq_off.tail);
+    cq_mask = (unsigned *) ((char *) cq_ptr + p.cq_off.ring_mask);
+    cqes = (char *) cq_ptr + p.cq_off.cqes;
+    sqes = sqe_ptr;
+    return true;
+}
+
+bool AsyncIO::queue(int opcode, int fd, void *buf, uint32_t len, uint64_t off, uint64_t user_data)
+{
+    // never queue more than the ring size, so the completion queue can't overflow
+    if (inflight >= entries) return false;
+
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    auto sqe = &((struct io_uring_sqe *) sqes)[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    to_submit++;
+    inflight++;
+    return true;
+}
+
+bool AsyncIO::queueRead(int fd, void *buf, uint32_t len, uint64_t off, uint64_t user_data)
+{
+    return queue(IORING_OP_READ, fd, buf, len, off, user_data);
+}
+
+void AsyncIO::waitCompletion(uint64_t &user_data, int64_t &result)
+{
+    VERIFY(inflight > 0);
+    while (1) {
+        unsigned head = *cq_head;
+        if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            auto cqe = &((struct io_uring_cqe *) cqes)[head & *cq_mask];
+            user_data = cqe->user_data;
+            result = cqe->res;
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            inflight--;
+            return;
+        }
+        int r = syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r >= 0) {
+            to_submit -= std::min((unsigned) r, to_submit);
+        } else {
+            VERIFY(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+        }
+    }
+}
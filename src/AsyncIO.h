@@ -0,0 +1,43 @@
+#pragma once
+
+// minimal io_uring wrapper (no liburing dependency)
+//   one instance must only be used by one thread at a time
+class AsyncIO {
+    int ring_fd = -1;
+    unsigned entries = 0;
+    unsigned inflight = 0;
+
+    void *sq_ptr = nullptr;
+    size_t sq_size = 0;
+    void *cq_ptr = nullptr;
+    size_t cq_size = 0;
+    void *sqe_ptr = nullptr;
+    size_t sqe_size = 0;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void *cqes;
+    void *sqes;
+    unsigned to_submit = 0;
+
+    bool init(unsigned n);
+    bool queue(int opcode, int fd, void *buf, uint32_t len, uint64_t off, uint64_t user_data);
+
+public:
+    AsyncIO() {}
+    ~AsyncIO();
+    AsyncIO(const AsyncIO &) = delete;
+    AsyncIO& operator= (const AsyncIO &) = delete;
+
+    static std::unique_ptr<AsyncIO> create(unsigned n); // nullptr if io_uring is unavailable
+
+    unsigned capacity() { return entries; }
+    unsigned pending() { return inflight; }
+
+    // queue a request, return false if queue is full
+    bool queueRead(int fd, void *buf, uint32_t len, uint64_t off, uint64_t user_data);
+
+    // submit queued requests and wait for one completion
+    //   result is bytes transferred or -errno
+    void waitCompletion(uint64_t &user_data, int64_t &result);
+};
@@ -0,0 +1,74 @@
+#include "config.h"
+
+#include <atomic>
+#include <unistd.h>
+#include <linux/fiemap.h>
+
+#include "BtrfsCsum.h"
+#include "KernelInterface.h"
+
+BtrfsCsum::~BtrfsCsum()
+{
+    KernelInterface::closeFD(fd);
+}
+
+std::unique_ptr<BtrfsCsum> BtrfsCsum::open(const std::string &file_name, uint64_t block_size)
+{
+    int fd = KernelInterface::openFD(file_name, O_RDONLY);
+    if (fd < 0) return nullptr;
+    BtrfsCsumInfo csum_info;
+    if (!KernelInterface::getBtrfsCsumInfo(fd, csum_info) || csum_info.sector_size != block_size) {
+        KernelInterface::closeFD(fd);
+        return nullptr;
+    }
+    return std::make_unique<BtrfsCsum>(fd, csum_info);
+}
+
+bool BtrfsCsum::usable(uint32_t extent_flags)
+{
+    // encoded extents have checksums of encoded data, preallocated and inline data have none
+    return !(extent_flags & (FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_UNWRITTEN | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED));
+}
+
+uint64_t BtrfsCsum::makeKey(const uint8_t *csum, uint32_t csum_size)
+{
+    uint64_t key = 0;
+    memcpy(&key, csum, std::min<uint32_t>(csum_size, sizeof(key)));
+    return key;
+}
+
+bool BtrfsCsum::fetch(uint64_t physical_off, uint64_t length, std::function<void(uint64_t physical_off, uint64_t key)> key_callback)
+{
+    if (failed) return false;
+    bool success = KernelInterface::getBtrfsCsums(fd, csum_info, physical_off, length, [&](uint64_t bytenr, const uint8_t *csum) {
+        key_callback(bytenr, makeKey(csum, csum_info.csum_size));
+    });
+    if (!success) {
+        // e.g. EPERM, don't try again
+        static std::atomic<bool> warned(false);
+        if (!warned.exchange(true)) {
+            LOG("warning: can't read btrfs checksums (%s), blocks are read instead.\n", KernelInterface::getError(errno));
+        }
+        failed = true;
+    }
+    return success;
+}
+
+bool BtrfsCsum::lookup(uint64_t physical_off, uint64_t &key)
+{
+    if (physical_off < window_begin || physical_off >= window_end) {
+        uint64_t n = window_size / csum_info.sector_size;
+        window_begin = physical_off - physical_off % csum_info.sector_size;
+        window_end = window_begin + n * csum_info.sector_size;
+        keys.assign(n, 0);
+        found.assign(n, false);
+        fetch(window_begin, window_end - window_begin, [&](uint64_t bytenr, uint64_t csum_key) {
+            keys[(bytenr - window_begin) / csum_info.sector_size] = csum_key;
+            found[(bytenr - window_begin) / csum_info.sector_size] = true;
+        });
+    }
+    if (physical_off % csum_info.sector_size) return false;
+    uint64_t i = (physical_off - window_begin) / csum_info.sector_size;
+    key = keys[i];
+    return found[i];
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "KernelInterface.h"
+
+// btrfs data checksums of one file system, fetched in windows of physical address
+//   owns fd, one instance must only be used by one thread at a time
+class BtrfsCsum {
+    int fd;
+    BtrfsCsumInfo csum_info;
+    bool failed = false;
+
+    uint64_t window_begin = 0;
+    uint64_t window_end = 0;
+    std::vector<uint64_t> keys; // checksum key of each sector in window
+    std::vector<bool> found;
+
+public:
+    uint64_t window_size = 1048576; // bytes of physical address fetched together
+
+    BtrfsCsum(int _fd, const BtrfsCsumInfo &_csum_info) : fd(_fd), csum_info(_csum_info) {}
+    ~BtrfsCsum();
+    BtrfsCsum(const BtrfsCsum &) = delete;
+    BtrfsCsum& operator= (const BtrfsCsum &) = delete;
+
+    static std::unique_ptr<BtrfsCsum> open(const std::string &file_name, uint64_t block_size); // nullptr if not btrfs or sector size differs
+    static bool usable(uint32_t extent_flags); // checksum is of the plain data at physical offset
+    static uint64_t makeKey(const uint8_t *csum, uint32_t csum_size); // first 8 bytes of checksum
+
+    bool lookup(uint64_t physical_off, uint64_t &key); // false if block has no checksum
+    bool fetch(uint64_t physical_off, uint64_t length, std::function<void(uint64_t physical_off, uint64_t key)> key_callback);
+};
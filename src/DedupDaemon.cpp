@@ -0,0 +1,225 @@
+#include "config.h"
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "DedupDaemon.h"
+#include "DedupInstance.h"
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void stop_handler(int)
+{
+    stop_requested = 1;
+}
+
+static std::string absolute_path(const std::string &path)
+{
+    if (!path.empty() && path[0] == '/') {
+        return path;
+    }
+    char buf[PATH_MAX];
+    VERIFY(getcwd(buf, sizeof(buf)) != NULL);
+    return std::string(buf) + "/" + path;
+}
+
+DedupDaemon::~DedupDaemon()
+{
+    if (inotify_fd >= 0) close(inotify_fd);
+}
+
+bool DedupDaemon::init()
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        printf("inotify_init1() failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    // don't dedup our own temporary files
+    ignored_prefix.push_back(absolute_path(config.chunk_file));
+    ignored_prefix.push_back(absolute_path(config.hash_storage.stor_path) + ".");
+    if (!config.hash_index_file.empty()) {
+        ignored_prefix.push_back(absolute_path(config.hash_index_file));
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    return true;
+}
+
+void DedupDaemon::addWatch(const std::string &dir)
+{
+    char buf[PATH_MAX];
+    if (!realpath(dir.c_str(), buf)) {
+        printf("realpath() failed: %s: %s\n", strerror(errno), dir.c_str());
+        return;
+    }
+    watchTree(buf, false);
+}
+
+void DedupDaemon::watchTree(const std::string &dir, bool queue_files)
+{
+    int wd = inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK);
+    if (wd < 0) {
+        printf("inotify_add_watch() failed: %s: %s\n", strerror(errno), dir.c_str());
+        return;
+    }
+    if (!watch_dirs.insert(std::make_pair(wd, dir)).second) {
+        // already watched
+        return;
+    }
+
+    DIR *dp = opendir(dir.c_str());
+    if (!dp) {
+        printf("opendir() failed: %s: %s\n", strerror(errno), dir.c_str());
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        std::string path = (dir == "/" ? "" : dir) + "/" + de->d_name;
+        unsigned char type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(path.c_str(), &st) < 0) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            watchTree(path, queue_files);
+        } else if (type == DT_REG && queue_files) {
+            queueFile(path);
+        }
+    }
+    closedir(dp);
+}
+
+void DedupDaemon::queueFile(const std::string &file_name)
+{
+    for (auto &prefix: ignored_prefix) {
+        if (file_name.compare(0, prefix.size(), prefix) == 0) return;
+    }
+
+    struct stat st;
+    if (lstat(file_name.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) return;
+
+    // closing files after dedup also generates IN_CLOSE_WRITE, but ctime is unchanged
+    auto it = cycle_files.find(file_name);
+    if (it != cycle_files.end() && it->second == (uint64_t) st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec) return;
+
+    pending.insert(file_name);
+}
+
+void DedupDaemon::readEvents()
+{
+    alignas(struct inotify_event) char buf[65536];
+    while (1) {
+        ssize_t len = read(inotify_fd, buf, sizeof(buf));
+        if (len < 0) {
+            VERIFY(errno == EAGAIN || errno == EINTR);
+            if (errno == EAGAIN) return;
+            continue;
+        }
+        for (char *p = buf; p < buf + len; ) {
+            auto ev = (struct inotify_event *) p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // some events are lost, rescan everything
+                LOG("warning: inotify queue overflowed, rescanning all watched directories.\n");
+                std::vector<std::string> dirs;
+                for (auto &[wd, dir]: watch_dirs) {
+                    dirs.push_back(dir);
+                }
+                watch_dirs.clear();
+                for (auto &dir: dirs) {
+                    watchTree(dir, true);
+                }
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                watch_dirs.erase(ev->wd);
+                continue;
+            }
+            auto it = watch_dirs.find(ev->wd);
+            if (it == watch_dirs.end() || ev->len == 0 || !ev->name[0]) continue;
+
+            std::string path = (it->second == "/" ? "" : it->second) + "/" + ev->name;
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    watchTree(path, true);
+                }
+            } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                queueFile(path);
+            }
+        }
+    }
+}
+
+void DedupDaemon::runCycle()
+{
+    std::vector<std::string> files(pending.begin(), pending.end());
+    pending.clear();
+
+    LOG("daemon: dedup cycle for %zu changed files\n", files.size());
+    LOG("\n");
+
+    std::unordered_map<std::string, uint64_t> hashed_files;
+    {
+        DedupInstance d;
+        d.copyOptions(config);
+        d.index_files = !config.hash_index_file.empty();
+        d.info_callback = [&](const std::string &file_name, const FileInfo &info) {
+            hashed_files[file_name] = info.ctime_ns;
+        };
+        for (auto &file_name: files) {
+            d.addFile(file_name);
+        }
+        d.doDedup();
+    }
+    cycle_files.swap(hashed_files);
+
+    LOG("\n");
+}
+
+void DedupDaemon::run()
+{
+    if (config.hash_index_file.empty()) {
+        LOG("warning: without hash index, changed files are only deduplicated among themselves.\n");
+    }
+    LOG("daemon: watching %zu directories, dedup every %" PRIu64 " seconds\n", watch_dirs.size(), interval);
+    LOG("\n");
+
+    time_t next_cycle = time(NULL) + interval;
+    while (!stop_requested) {
+        time_t now = time(NULL);
+        if (pending.size() >= max_pending || (now >= next_cycle && !pending.empty())) {
+            runCycle();
+            next_cycle = time(NULL) + interval;
+            continue;
+        }
+        if (now >= next_cycle) {
+            next_cycle = now + interval;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = inotify_fd;
+        pfd.events = POLLIN;
+        int r = poll(&pfd, 1, std::min<time_t>(next_cycle - now, 3600) * 1000);
+        if (r > 0) {
+            readEvents();
+        } else if (r < 0) {
+            VERIFY(errno == EINTR);
+        }
+    }
+
+    LOG("daemon: stopped, %zu changed files not deduped\n", pending.size());
+}
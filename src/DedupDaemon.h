@@ -0,0 +1,35 @@
+#pragma once
+
+#include "DedupInstance.h"
+
+// resident mode: watch directories with inotify, dedup changed files periodically
+//   each cycle is a new DedupInstance with options copied from 'config'
+//   with a hash index, changed files are matched against hashes of indexed files, without mapping or reading those
+class DedupDaemon {
+    DedupInstance &config;
+
+    int inotify_fd = -1;
+    std::unordered_map<int/*wd*/, std::string/*dir*/> watch_dirs;
+
+    std::set<std::string> pending; // changed files, not yet deduped
+    std::unordered_map<std::string, uint64_t/*ctime_ns*/> cycle_files; // files of last cycle, to ignore events caused by ourselves
+    std::vector<std::string> ignored_prefix; // our own temporary files
+
+    void watchTree(const std::string &dir, bool queue_files);
+    void queueFile(const std::string &file_name);
+    void readEvents();
+    void runCycle();
+
+public:
+    uint64_t interval = 600; // seconds between cycles
+    uint64_t max_pending = 100000; // start a cycle early when so many files are pending
+
+    DedupDaemon(DedupInstance &_config) : config(_config) {}
+    ~DedupDaemon();
+    DedupDaemon(const DedupDaemon &) = delete;
+    DedupDaemon& operator= (const DedupDaemon &) = delete;
+
+    bool init();
+    void addWatch(const std::string &dir);
+    void run();
+};
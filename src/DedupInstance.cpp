@@ -1,17 +1,52 @@
 #include "config.h"
 
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/fiemap.h>
+
+#include <atomic>
+
 #include "xxhash.h"
 
 #include "DedupInstance.h"
 #include "HashStorage.h"
+#include "HashCache.h"
+#include "HashIndex.h"
+#include "HashPipeline.h"
+#include "BtrfsCsum.h"
 #include "KernelInterface.h"
+#include "WorkerPool.h"
 
 DedupInstance::~DedupInstance()
 {
-    for (auto &f: file_list) {
-        KernelInterface::closeFD(f.fd);
-    }
-    KernelInterface::closeFD(tmp_fd);
+    closeWorkers();
+}
+
+void DedupInstance::copyOptions(const DedupInstance &other)
+{
+    hash_storage.sort_mem = other.hash_storage.sort_mem;
+    hash_storage.stor_path = other.hash_storage.stor_path;
+    hash_cache.max_entries = other.hash_cache.max_entries;
+    chunk_file = other.chunk_file;
+    hash_index_file = other.hash_index_file;
+    block_size = other.block_size;
+    ref_limit = other.ref_limit;
+    hash_threads = other.hash_threads;
+    physical_order = other.physical_order;
+    order_window = other.order_window;
+    index_files = other.index_files;
+    btrfs_csum = other.btrfs_csum;
+    prefetch_size = other.prefetch_size;
+    chunk_limit = other.chunk_limit;
+    relocate_enable = other.relocate_enable;
+    dedup_enable = other.dedup_enable;
+    unit_size = other.unit_size;
+    whole_file = other.whole_file;
+    punch_zero = other.punch_zero;
+    inplace_source = other.inplace_source;
+    relocate_all = other.relocate_all;
+    submit_window = other.submit_window;
+    dedup_threads = other.dedup_threads;
 }
 
 void DedupInstance::addFile(const std::string &file_name)
@@ -19,29 +54,28 @@ void DedupInstance::addFile(const std::string &file_name)
     file_list.push_back(FileItem(file_name));
 }
 
-int DedupInstance::getFD(std::vector<FileItem>::iterator f)
+int DedupInstance::getFD(Worker &w, std::vector<FileItem>::iterator f)
 {
-    if (f->opened_it.has_value()) {
+    auto it = w.opened_it.find(&*f);
+    if (it != w.opened_it.end()) {
         // file is in cache
-        auto it = std::any_cast<std::list<std::vector<FileItem>::iterator>::iterator>(f->opened_it);
-        opened_file.splice(opened_file.begin(), opened_file, it);
-        return f->fd;
+        w.opened_file.splice(w.opened_file.begin(), w.opened_file, it->second);
+        return it->second->second;
 
     } else {
         // not in cache
-        f->fd = KernelInterface::openFD(f->file_name);
-        opened_file.push_front(f);
-        f->opened_it = opened_file.begin();
+        int fd = KernelInterface::openFD(f->file_name);
+        w.opened_file.push_front(std::make_pair(&*f, fd));
+        w.opened_it[&*f] = w.opened_file.begin();
 
         // shrink cache
-        while (opened_file.size() > ref_limit) {
-            auto it = opened_file.back();
-            KernelInterface::closeFD(it->fd);
-            it->fd = -1;
-            it->opened_it.reset();
-            opened_file.pop_back();
+        while (w.opened_file.size() > ref_limit) {
+            auto &[old_f, old_fd] = w.opened_file.back();
+            KernelInterface::closeFD(old_fd);
+            w.opened_it.erase(old_f);
+            w.opened_file.pop_back();
         }
-        return f->fd;
+        return fd;
     }
 }
 
@@ -50,255 +84,1401 @@ std::vector<DedupInstance::FileItem>::iterator DedupInstance::getFileItemByLogic
     FileItem t; t.logical_id_base = logical_id;
     return --std::upper_bound(file_list.begin(), file_list.end(), t, [](const auto &lhs, const auto &rhs){ return lhs.logical_id_base < rhs.logical_id_base; });
 }
+uint64_t DedupInstance::unitCount(uint64_t file_size)
+{
+    // whole units, then the block-aligned rest of the last unit, then the sub-block remainder at EOF
+    return file_size / unit_size + (file_size % unit_size >= block_size) + (file_size % block_size != 0);
+}
+uint64_t DedupInstance::unitOffset(std::vector<FileItem>::iterator f, uint64_t logical_id)
+{
+    // only the sub-block remainder is past the block-aligned size
+    return std::min((logical_id - f->logical_id_base) * unit_size, f->size / block_size * block_size);
+}
+uint64_t DedupInstance::unitLength(uint64_t logical_id)
+{
+    auto it = unaligned_blocks.find(logical_id);
+    return it != unaligned_blocks.end() ? it->second : unit_size;
+}
+
+DedupInstance::Extent *DedupInstance::findExtent(uint64_t physical_id)
+{
+    auto it = std::upper_bound(extents.begin(), extents.end(), physical_id, [](uint64_t id, const Extent &e) { return id < e.begin; });
+    if (it == extents.begin() || physical_id >= std::prev(it)->end) return nullptr;
+    return &*std::prev(it);
+}
+
+void DedupInstance::findCsumCollisions()
+{
+    // collect btrfs checksums of all blocks, without reading data
+    //   a checksum key is a collision if different physical blocks have it
+    //   other blocks are unique, their hashes are derived from checksums later
+    HashStorage csum_storage;
+    csum_storage.sort_mem = hash_storage.sort_mem;
+    csum_storage.stor_path = hash_storage.stor_path + ".csum";
+    csum_storage.comparator = [](const auto &lhs, const auto &rhs) {
+        return std::tie(lhs.hash_value, lhs.physical_id) < std::tie(rhs.hash_value, rhs.physical_id);
+    };
+
+    LOG("  collecting btrfs checksums ...\n");
+    resetProgress();
+    uint64_t n_csums = 0;
+    csum_storage.beginEmitRecord();
+    for (auto &f: file_list) {
+        auto csum = BtrfsCsum::open(f.file_name, block_size);
+        if (!csum) continue;
+        KernelInterface::getFileExtents(f.file_name, block_size, [](const FileInfo &) {}, [&](const FileExtent &extent) {
+            if (!BtrfsCsum::usable(extent.flags)) return;
+            csum->fetch(extent.physical_off, extent.length, [&](uint64_t physical_off, uint64_t key) {
+                HashRecord record;
+                record.hash_value = key;
+                record.logical_id = 0;
+                record.physical_id = physical_off / block_size;
+                csum_storage.emitRecord(record);
+                n_csums++;
+            });
+        });
+        if (shouldPrintProgress()) {
+            LOG("  progress: now collected %" PRIu64 " checksums\n", n_csums);
+        }
+    }
+    csum_storage.finishEmitRecord();
+
+    csum_collisions.clear();
+    bool have = false;
+    HashRecord last;
+    csum_storage.iterateSortedRecord([&](const HashRecord &record) {
+        if (have && record.hash_value == last.hash_value && record.physical_id != last.physical_id) {
+            if (csum_collisions.empty() || csum_collisions.back() != record.hash_value) {
+                csum_collisions.push_back(record.hash_value);
+            }
+        }
+        have = true;
+        last = record;
+    });
+    LOG("  %" PRIu64 " checksums collected, %zu of them collide.\n", n_csums, csum_collisions.size());
+}
+
+void DedupInstance::findWholeFiles(std::function<HashLookup(size_t file_idx, const FileInfo &info)> make_lookup)
+{
+    // files of same size are candidates, compared by a cheap fingerprint (head and tail) first, then by hashes of all blocks
+    //   one file of each confirmed group stays in block hashing, so other files can still share its blocks
+    //   the others are left out, and deduped against it as whole files after block dedup in step 2
+    struct Candidate {
+        size_t file_idx;
+        uint64_t size;
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t fingerprint = 0;
+        uint64_t content = 0; // chained hash of (logical_off, hash_value) of all blocks
+        uint64_t layout = 0; // chained hash of (logical_off, physical_off) of all blocks
+        FileInfo info;
+    };
+    auto same_size = [](const Candidate &lhs, const Candidate &rhs) { return lhs.size == rhs.size; };
+    auto same_fingerprint = [](const Candidate &lhs, const Candidate &rhs) { return lhs.size == rhs.size && lhs.fingerprint == rhs.fingerprint; };
+    auto same_content = [](const Candidate &lhs, const Candidate &rhs) { return lhs.size == rhs.size && lhs.content == rhs.content; };
+    auto keep_groups = [](std::vector<Candidate> &cands, std::function<bool(const Candidate &, const Candidate &)> same) {
+        // drop candidates with nothing to compare with, cands must be sorted
+        std::vector<Candidate> kept;
+        for (size_t i = 0, j; i < cands.size(); i = j) {
+            for (j = i + 1; j < cands.size() && same(cands[i], cands[j]); j++);
+            if (j - i > 1) {
+                kept.insert(kept.end(), cands.begin() + i, cands.begin() + j);
+            }
+        }
+        cands.swap(kept);
+    };
+
+    LOG("  finding whole-file duplicates ...\n");
+    std::vector<Candidate> cands;
+    for (size_t file_idx = 0; file_idx < file_list.size(); file_idx++) {
+        struct stat st;
+        if (lstat(file_list[file_idx].file_name.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            Candidate c;
+            c.file_idx = file_idx;
+            c.size = st.st_size;
+            c.dev = st.st_dev;
+            c.ino = st.st_ino;
+            cands.push_back(c);
+        }
+    }
+    std::sort(cands.begin(), cands.end(), [](const auto &lhs, const auto &rhs) { return lhs.size < rhs.size; });
+    keep_groups(cands, same_size);
+
+    std::vector<char> buffer(2 * block_size);
+    for (auto &c: cands) {
+        int fd = KernelInterface::openFD(file_list[c.file_idx].file_name, O_RDONLY);
+        if (fd < 0) continue;
+        uint64_t n = std::min(c.size, block_size);
+        if (pread(fd, buffer.data(), n, 0) == (ssize_t) n && pread(fd, buffer.data() + n, n, c.size - n) == (ssize_t) n) {
+            c.fingerprint = XXH64(buffer.data(), 2 * n, 0);
+        }
+        KernelInterface::closeFD(fd);
+    }
+    std::sort(cands.begin(), cands.end(), [](const auto &lhs, const auto &rhs) { return std::tie(lhs.size, lhs.fingerprint) < std::tie(rhs.size, rhs.fingerprint); });
+    keep_groups(cands, same_fingerprint);
+
+    // hashes of full blocks come from index and caches if possible
+    //   read files go into hash index here, files left out of block hashing aren't seen again
+    resetProgress();
+    uint64_t read_bytes = 0;
+    for (auto &c: cands) {
+        auto &f = file_list[c.file_idx];
+        LookupQueue lookups;
+        bool failed = false;
+        bool unmapped = false;
+        std::vector<std::pair<uint64_t/*block_idx*/, uint64_t/*hash_value*/>> index_blocks;
+        bool success = KernelInterface::getFileBlocks(f.file_name, block_size, [&](const FileInfo &info) {
+            failed = info.size != c.size;
+            c.info = info;
+            auto lookup = make_lookup(c.file_idx, info);
+            lookups = LookupQueue([&, lookup](uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags, uint64_t &hash_value) {
+                // hashes derived from btrfs checksums are too weak to prove files identical
+                HashSource hash_source = data_size == block_size ? lookup(physical_off, logical_off, data_size, extent_flags, hash_value) : HASH_READ;
+                if (hash_source == HASH_CSUM || (hash_source == HASH_INDEX && btrfs_csum)) {
+                    hash_source = HASH_READ;
+                }
+                return hash_source;
+            });
+        }, [&](uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags, auto read_data) {
+            uint64_t hash_value;
+            HashSource hash_source = lookups.take(hash_value);
+            if (failed || logical_off >= c.size) return;
+            if (hash_source == HASH_READ) {
+                char *data = read_data();
+                if (!data) {
+                    failed = true;
+                    return;
+                }
+                hash_value = XXH64(data, data_size, 0);
+                read_bytes += data_size;
+                if (data_size == block_size && HashCache::cacheable(extent_flags)) {
+                    hash_cache.put(physical_off / block_size, hash_value);
+                }
+            }
+            if (hash_index) {
+                // same as block hashing, which doesn't hash partial blocks
+                index_blocks.push_back(std::make_pair(logical_off / block_size, data_size == block_size ? hash_value : -1));
+            }
+            uint64_t content[3] = { c.content, logical_off, hash_value };
+            c.content = XXH64(content, sizeof(content), 0);
+            uint64_t layout[3] = { c.layout, logical_off, physical_off };
+            c.layout = XXH64(layout, sizeof(layout), 0);
+            unmapped = unmapped || !KernelInterface::hasPhysicalAddress(extent_flags);
+        }, [&](uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags) {
+            bool need = lookups.needData(physical_off, logical_off, data_size, extent_flags);
+            return need && !failed && logical_off < c.size;
+        });
+        if (unmapped) {
+            // physical 0 of delalloc extents doesn't mean files share data
+            c.layout = -1 - c.file_idx;
+        }
+        if (!success || failed) {
+            // never equal to others
+            c.content = -1 - c.file_idx;
+        } else if (hash_index) {
+            hash_index->beginFile(f.file_name, c.info);
+            for (auto &[block_idx, hash_value]: index_blocks) {
+                hash_index->addBlock(block_idx, hash_value);
+            }
+            hash_index->finishFile();
+            f.indexed = true;
+        }
+        if (shouldPrintProgress()) {
+            LOG("  progress: now read %s of candidates\n", HB(read_bytes));
+        }
+    }
+    std::sort(cands.begin(), cands.end(), [](const auto &lhs, const auto &rhs) { return std::tie(lhs.size, lhs.content, lhs.dev, lhs.ino) < std::tie(rhs.size, rhs.content, rhs.dev, rhs.ino); });
+    keep_groups(cands, same_content);
+
+    // hard links are deduped once, the first file is the representative
+    //   groups of hard links only, or already sharing all extents, need no work and stay in block hashing
+    std::vector<bool> left_out(file_list.size());
+    for (size_t i = 0, j; i < cands.size(); i = j) {
+        std::vector<std::string> group;
+        bool deduped = true;
+        uint64_t n_blocks = (cands[i].size + block_size - 1) / block_size;
+        for (j = i; j < cands.size() && same_content(cands[i], cands[j]); j++) {
+            if (j == i || cands[j].dev != cands[j - 1].dev || cands[j].ino != cands[j - 1].ino) {
+                group.push_back(file_list[cands[j].file_idx].file_name);
+                deduped = deduped && cands[j].layout == cands[i].layout;
+            }
+        }
+        if (group.size() < 2 || deduped) continue;
+        for (size_t k = i + 1; k < j; k++) {
+            left_out[cands[k].file_idx] = true;
+            whole_files++;
+            if (info_callback) {
+                // block hashing won't map it
+                info_callback(file_list[cands[k].file_idx].file_name, cands[k].info);
+            }
+        }
+        // every ref_limit files keep their own copy, the representative's blocks are counted by block hashing
+        whole_before_blocks += (group.size() - 1) * n_blocks;
+        whole_after_blocks += ((group.size() + ref_limit - 1) / ref_limit - 1) * n_blocks;
+        whole_file_bytes += (group.size() - 1) * cands[i].size;
+        whole_groups.push_back(std::make_pair(cands[i].size, group));
+    }
+
+    size_t n = 0;
+    for (size_t file_idx = 0; file_idx < file_list.size(); file_idx++) {
+        if (!left_out[file_idx]) {
+            if (n != file_idx) {
+                // self-move would empty the name
+                file_list[n] = std::move(file_list[file_idx]);
+            }
+            n++;
+        }
+    }
+    file_list.resize(n);
+    LOG("  found %" PRIu64 " files with whole-file duplicates, %zu groups to dedup.\n", whole_files, whole_groups.size());
+}
 
 void DedupInstance::hashFiles()
 {
     // hash each block of each file (skip already deduped blocks)
 
-    hash_storage.comparator = [](const auto &lhs, const auto &rhs) {
-        return std::tie(lhs.hash_value, lhs.logical_id) < std::tie(rhs.hash_value, rhs.logical_id);
+    // units of files from hash index come first among equal hashes
+    hash_storage.comparator = [this](const auto &lhs, const auto &rhs) {
+        return std::make_tuple(lhs.hash_value, lhs.logical_id < reference_id_base, lhs.logical_id) < std::make_tuple(rhs.hash_value, rhs.logical_id < reference_id_base, rhs.logical_id);
     };
 
     resetProgress();
 
     auto physical_set = std::make_unique<BitVector>();
-    hash_storage.beginEmitRecord();
-    for (auto &f: file_list) {
-        bool success = KernelInterface::getFileBlocks(f.file_name, block_size, [&](uint64_t file_size) {
-            f.size = file_size;
-            f.logical_id_base = n_logical_id;
-            n_logical_id += (f.size + block_size - 1) / block_size;
-        }, [&](uint64_t physical_off, uint64_t logical_off, uint64_t data_size, auto read_data) {
-            HashRecord hash_record;
-            char *buffer;
+    // zero blocks are common in images and preallocated files, checking is much cheaper than hashing
+    uint64_t zero_hash = XXH64(std::vector<char>(block_size).data(), block_size, 0);
+    auto hash_block = [&](const char *buffer, uint64_t data_size) -> uint64_t {
+        if (data_size != block_size) return -1;
+        return KernelInterface::isZero(buffer, block_size) ? zero_hash : XXH64(buffer, block_size, 0);
+    };
+
+    // find hashes without reading data: unchanged files in hash index, reflinked blocks seen before
+    //   called on reader threads
+    auto make_lookup = [&](size_t file_idx, const FileInfo &info) -> HashLookup {
+        std::shared_ptr<HashIndex::Cursor> cursor;
+        if (hash_index) {
+            cursor = hash_index->open(info);
+        }
+        std::shared_ptr<BtrfsCsum> csum;
+        if (btrfs_csum) {
+            csum = BtrfsCsum::open(file_list[file_idx].file_name, block_size);
+        }
+        return [&, cursor, csum](uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags, uint64_t &hash_value) -> HashSource {
+            // blocks with colliding checksums are always read, index may hold hashes derived from checksums
+            bool collide = false;
+            uint64_t key;
+            if (csum && data_size == block_size && BtrfsCsum::usable(extent_flags) && csum->lookup(physical_off, key)) {
+                if (!std::binary_search(csum_collisions.begin(), csum_collisions.end(), key)) {
+                    hash_value = XXH64(&key, sizeof(key), CSUM_HASH_SEED);
+                    return HASH_CSUM;
+                }
+                collide = true;
+            }
+            if (!collide && cursor && cursor->lookup(logical_off / block_size, hash_value)) {
+                return HASH_INDEX;
+            }
+            if (data_size == block_size && HashCache::cacheable(extent_flags) && hash_cache.get(physical_off / block_size, hash_value)) {
+                return HASH_REFLINK;
+            }
+            return HASH_READ;
+        };
+    };
+    auto store_hash = [&](const HashedBlock &block) {
+        if (block.data_size == block_size && HashCache::cacheable(block.extent_flags)) {
+            hash_cache.put(block.physical_off / block_size, block.hash_value);
+        }
+    };
+
+    // called in file order
+    auto file_info = [&](FileItem &f, const FileInfo &info) {
+        f.size = info.size;
+        f.logical_id_base = n_logical_id;
+        n_logical_id += unitCount(f.size);
+        if (hash_index && !f.indexed) {
+            hash_index->beginFile(f.file_name, info);
+        }
+        if (info_callback) {
+            info_callback(f.file_name, info);
+        }
+    };
+    // blocks are collected into units, a unit is emitted once all its blocks are seen
+    //   blocks of a unit may come in any order, units with holes or read errors are dropped
+    //   a file tail shorter than unit_size is a short unit, hashed with its length so it only matches tails of the same length
+    struct Unit {
+        uint64_t data_size = 0;
+        bool failed = false;
+        bool unmapped = false; // some block has no physical address yet
+        std::vector<std::pair<uint64_t/*physical_off*/, uint64_t/*hash_value*/>> blocks;
+    };
+    std::map<uint64_t/*logical_id*/, Unit> pending_units;
+    uint64_t dropped_units = 0;
+    std::unordered_set<uint64_t> listed_hashes; // of listed units, files from hash index are matched against them
+    auto unit_record = [&](uint64_t logical_id, uint64_t data_size, const Unit &unit) -> HashRecord {
+        HashRecord hash_record;
+        hash_record.logical_id = logical_id;
+        hash_record.hash_value = unit.blocks[0].second;
+        hash_record.physical_id = unit.blocks[0].first / block_size;
+        if (unit.blocks.size() > 1 || data_size != unit_size) {
+            std::vector<uint64_t> hashes;
+            bool contiguous = true;
+            for (size_t k = 0; k < unit.blocks.size(); k++) {
+                hashes.push_back(unit.blocks[k].second);
+                contiguous = contiguous && unit.blocks[k].first == unit.blocks[0].first + k * block_size;
+            }
+            hash_record.hash_value = XXH64(hashes.data(), hashes.size() * sizeof(uint64_t), data_size == unit_size ? 0 : data_size);
+            if (!contiguous) {
+                // never equal to another unit, so never taken as already deduped
+                hash_record.physical_id = SCATTERED_UNIT | logical_id;
+            }
+        }
+        if (unit.unmapped) {
+            hash_record.physical_id = SCATTERED_UNIT | logical_id;
+        }
+        return hash_record;
+    };
+    auto emit_unit = [&](uint64_t logical_id, uint64_t data_size, const Unit &unit) {
+        if (punch_zero && data_size == unit_size && std::all_of(unit.blocks.begin(), unit.blocks.end(), [&](const auto &b) { return b.second == zero_hash; })) {
+            zero_blocks++;
+            if (!zero_ranges.empty() && zero_ranges.back().first + zero_ranges.back().second == logical_id) {
+                zero_ranges.back().second++;
+            } else {
+                zero_ranges.push_back(std::make_pair(logical_id, 1));
+            }
+            return;
+        }
+        HashRecord hash_record = unit_record(logical_id, data_size, unit);
+        if (data_size != unit_size) {
+            unaligned_blocks.insert(std::make_pair(logical_id, data_size));
+        }
+        if (index_files && data_size % block_size == 0) {
+            listed_hashes.insert(hash_record.hash_value);
+        }
+        hash_storage.emitRecord(hash_record);
+    };
+    auto drop_units = [&](uint64_t logical_id_begin, uint64_t logical_id_end) {
+        auto begin = pending_units.lower_bound(logical_id_begin);
+        auto end = pending_units.lower_bound(logical_id_end);
+        dropped_units += std::distance(begin, end);
+        pending_units.erase(begin, end);
+    };
 
-            uint64_t physical_id = physical_off / block_size;
+    // blocks of an extent come one after another, also in physical order
+    FileItem *extent_file = nullptr;
+    uint64_t extent_next_logical, extent_next_physical;
+    auto file_block = [&](FileItem &f, const HashedBlock &block) {
+        uint64_t physical_id = block.physical_off / block_size;
+        bool mapped = KernelInterface::hasPhysicalAddress(block.extent_flags);
+        if (!mapped) {
+            // each block will get its own address
+            physical_blocks++;
+            extent_file = nullptr;
+        } else {
             physical_set->ensure(physical_id + 1);
             if (!physical_set->get(physical_id)) {
                 physical_blocks++;
                 physical_set->set(physical_id, true);
             }
-            
-            hash_record.logical_id = f.logical_id_base + logical_off / block_size;
-            
-            if ((buffer = read_data())) {
-                hashed_blocks++;
-                if (data_size == block_size) {
-                    hash_record.hash_value = XXH64(buffer, block_size, 0);
-                } else {
-                    hash_record.hash_value = -1;
-                    unaligned_blocks.insert(std::make_pair(hash_record.logical_id, data_size));
-                }
-                hash_storage.emitRecord(hash_record);
-                if (shouldPrintProgress()) {
-                    LOG("  progress: now hashed %s of data\n", HB(hashed_blocks * block_size));
-                }
+
+            bool shared = block.extent_flags & FIEMAP_EXTENT_SHARED;
+            if (extent_file == &f && block.logical_off == extent_next_logical && block.physical_off == extent_next_physical) {
+                extents.back().end = physical_id + 1;
+                extents.back().shared = extents.back().shared || shared;
             } else {
-                // ignore error block
-                ignored_blocks++;
+                Extent extent;
+                extent.begin = physical_id;
+                extent.end = physical_id + 1;
+                extent.shared = shared;
+                extents.push_back(extent);
             }
-        });
+            extent_file = &f;
+            extent_next_logical = block.logical_off + block_size;
+            extent_next_physical = block.physical_off + block_size;
+        }
+
+        if (block.read_success) {
+            hashed_blocks++;
+            if (block.hash_source == HASH_REFLINK) {
+                reused_blocks++;
+            }
+            if (block.hash_source == HASH_CSUM) {
+                csum_blocks++;
+            }
+            if (block.hash_source == HASH_INDEX) {
+                unchanged_blocks++;
+            }
+            if (hash_index && !f.indexed) {
+                hash_index->addBlock(block.logical_off / block_size, block.hash_value);
+            }
+            if (shouldPrintProgress()) {
+                LOG("  progress: now hashed %s of data\n", HB(hashed_blocks * block_size));
+            }
+        } else {
+            // ignore error block
+            ignored_blocks++;
+        }
+
+        if (block.logical_off >= f.size) return;
+        // the sub-block remainder at EOF is a unit of its own
+        uint64_t aligned_size = f.size / block_size * block_size;
+        bool remainder = block.logical_off >= aligned_size;
+        uint64_t unit_off = remainder ? aligned_size : block.logical_off / unit_size * unit_size;
+        uint64_t unit_data_size = remainder ? f.size - aligned_size : std::min(unit_size, aligned_size - unit_off);
+        uint64_t logical_id = remainder ? f.logical_id_base + unitCount(f.size) - 1 : f.logical_id_base + unit_off / unit_size;
+        if (block.data_size == unit_data_size) {
+            // whole unit in a single block
+            if (block.read_success) {
+                Unit unit;
+                unit.unmapped = !mapped;
+                unit.blocks.push_back(std::make_pair(block.physical_off, block.hash_value));
+                emit_unit(logical_id, unit_data_size, unit);
+            }
+            return;
+        }
+        auto &unit = pending_units[logical_id];
+        if (unit.blocks.empty()) {
+            unit.blocks.resize((unit_data_size + block_size - 1) / block_size);
+        }
+        unit.blocks[(block.logical_off - unit_off) / block_size] = std::make_pair(block.physical_off, block.hash_value);
+        unit.data_size += block.data_size;
+        unit.failed = unit.failed || !block.read_success;
+        unit.unmapped = unit.unmapped || !mapped;
+        if (unit.data_size == unit_data_size) {
+            if (!unit.failed) {
+                emit_unit(logical_id, unit_data_size, unit);
+            } else {
+                dropped_units++;
+            }
+            pending_units.erase(logical_id);
+        }
+    };
+    auto file_finish = [&](FileItem &f, bool success) {
+        if (!physical_order) {
+            // all blocks of the file are seen
+            drop_units(f.logical_id_base, f.logical_id_base + unitCount(f.size));
+        }
         if (!success) {
             f.size = 0;
             f.logical_id_base = n_logical_id;
+        } else if (hash_index && !f.indexed) {
+            hash_index->finishFile();
+        }
+    };
+
+    // single-threaded read & hash
+    auto read_block = [&](FileItem &f, LookupQueue &lookups, uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags, const std::function<char *()> &read_data) {
+        HashedBlock block;
+        block.physical_off = physical_off;
+        block.logical_off = logical_off;
+        block.data_size = data_size;
+        block.extent_flags = extent_flags;
+        block.hash_source = lookups.take(block.hash_value);
+        if (block.hash_source != HASH_READ) {
+            block.read_success = true;
+        } else {
+            char *buffer = read_data();
+            block.read_success = buffer != nullptr;
+            if (buffer) {
+                block.hash_value = hash_block(buffer, data_size);
+                store_hash(block);
+            }
         }
+        file_block(f, block);
+    };
+
+    if (!hash_index_file.empty()) {
+        hash_index = std::make_unique<HashIndex>(hash_index_file, block_size);
+        hash_index->load();
+        if (physical_order) {
+            LOG("warning: --physical-order can't be used with hash index, ignored.\n");
+            physical_order = false;
+        }
+    }
+
+    if (whole_file) {
+        findWholeFiles(make_lookup);
+    }
+    if (btrfs_csum) {
+        findCsumCollisions();
+    }
+
+    // at most half of sort_mem stays in memory, group storage gets the other half
+    hash_storage.keep_mem = hash_storage.sort_mem * 1048576 / 2;
+    hash_storage.beginEmitRecord();
+    if (hash_threads > 1 && !physical_order) {
+        LOG("  hashing with %d threads ...\n", hash_threads);
+        HashPipeline pipeline(hash_threads, block_size);
+        pipeline.make_lookup = make_lookup;
+        pipeline.store_hash = store_hash;
+        pipeline.run(file_list.size(), [&](size_t file_idx) -> const std::string & {
+            return file_list[file_idx].file_name;
+        }, hash_block, [&](size_t file_idx, const FileInfo &info) {
+            file_info(file_list[file_idx], info);
+        }, [&](size_t file_idx, const HashedBlock &block) {
+            file_block(file_list[file_idx], block);
+        }, [&](size_t file_idx, bool success) {
+            file_finish(file_list[file_idx], success);
+        });
+    } else if (physical_order) {
+        // map extents of a window of files first, then read them in ascending physical order
+        LOG("  reading blocks in physical order ...\n");
+        std::vector<std::pair<size_t/*file_idx*/, FileExtent>> schedule;
+        for (size_t window_begin = 0; window_begin < file_list.size(); window_begin += order_window) {
+            size_t window_end = std::min(window_begin + order_window, (uint64_t) file_list.size());
+            std::vector<FileInfo> infos(window_end - window_begin);
+            schedule.clear();
+            for (size_t file_idx = window_begin; file_idx < window_end; file_idx++) {
+                auto &f = file_list[file_idx];
+                bool success = KernelInterface::getFileExtents(f.file_name, block_size, [&](const FileInfo &info) {
+                    file_info(f, info);
+                    infos[file_idx - window_begin] = info;
+                }, [&](const FileExtent &extent) {
+                    schedule.push_back(std::make_pair(file_idx, extent));
+                });
+                file_finish(f, success);
+            }
+            std::sort(schedule.begin(), schedule.end(), [](const auto &lhs, const auto &rhs) {
+                return std::tie(lhs.second.physical_off, lhs.first) < std::tie(rhs.second.physical_off, rhs.first);
+            });
+
+            // consecutive extents of the same file are read together
+            std::vector<FileExtent> extents;
+            for (size_t i = 0; i < schedule.size(); i++) {
+                auto file_idx = schedule[i].first;
+                extents.push_back(schedule[i].second);
+                if (i + 1 < schedule.size() && schedule[i + 1].first == file_idx) continue;
+
+                // lookups may hold a fd and a checksum window, only one is alive at a time
+                auto &f = file_list[file_idx];
+                int fd = KernelInterface::openReadFD(f.file_name);
+                LookupQueue file_lookups(make_lookup(file_idx, infos[file_idx - window_begin]));
+                KernelInterface::getExtentBlocks(fd, f.file_name, block_size, f.size, extents, [&](uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags, auto read_data) {
+                    read_block(f, file_lookups, physical_off, logical_off, data_size, extent_flags, read_data);
+                }, [&](uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags) {
+                    return file_lookups.needData(physical_off, logical_off, data_size, extent_flags);
+                });
+                KernelInterface::closeFD(fd);
+                extents.clear();
+            }
+            drop_units(0, n_logical_id);
+        }
+    } else {
+        for (size_t file_idx = 0; file_idx < file_list.size(); file_idx++) {
+            auto &f = file_list[file_idx];
+            LookupQueue lookups;
+            bool success = KernelInterface::getFileBlocks(f.file_name, block_size, [&](const FileInfo &info) {
+                file_info(f, info);
+                lookups = LookupQueue(make_lookup(file_idx, info));
+            }, [&](uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags, auto read_data) {
+                read_block(f, lookups, physical_off, logical_off, data_size, extent_flags, read_data);
+            }, [&](uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags) {
+                return lookups.needData(physical_off, logical_off, data_size, extent_flags);
+            });
+            file_finish(f, success);
+        }
+    }
+    if (dropped_units) {
+        LOG("  ignored %" PRIu64 " incomplete units (holes or read errors).\n", dropped_units);
+    }
+
+    // files in hash index but not in list are matched against without mapping or reading them
+    //   only their units with the hash of a listed unit are emitted, so work scales with listed files
+    //   they are appended to file_list, and only ever read as dedup source
+    if (hash_index && index_files) {
+        std::set<std::string> listed;
+        for (auto &f: file_list) {
+            listed.insert(f.file_name);
+        }
+        reference_id_base = n_logical_id;
+        size_t n_files = 0;
+        uint64_t n_units = 0;
+        hash_index->forEachFile([&](const std::string &file_name, const FileInfo &info) {
+            if (listed.find(file_name) != listed.end()) return;
+            auto cursor = hash_index->open(info);
+            if (!cursor) return;
+            file_list.push_back(FileItem(file_name));
+            auto f = std::prev(file_list.end());
+            f->size = info.size;
+            f->logical_id_base = n_logical_id;
+            f->indexed = true;
+            bool matched = false;
+            for (uint64_t logical_id = f->logical_id_base; logical_id < f->logical_id_base + unitCount(f->size); logical_id++) {
+                // sub-block remainder isn't hashed
+                uint64_t off = unitOffset(f, logical_id);
+                uint64_t data_size = std::min(unit_size, f->size / block_size * block_size - off);
+                if (data_size == 0) break;
+                Unit unit;
+                unit.unmapped = true;
+                for (uint64_t block_off = off; block_off < off + data_size; block_off += block_size) {
+                    uint64_t hash_value;
+                    if (!cursor->lookup(block_off / block_size, hash_value)) break;
+                    unit.blocks.push_back(std::make_pair(0, hash_value));
+                }
+                if (unit.blocks.size() * block_size != data_size) continue;
+                HashRecord hash_record = unit_record(logical_id, data_size, unit);
+                if (listed_hashes.find(hash_record.hash_value) == listed_hashes.end()) continue;
+                if (data_size != unit_size) {
+                    unaligned_blocks.insert(std::make_pair(logical_id, data_size));
+                }
+                hash_storage.emitRecord(hash_record);
+                matched = true;
+                n_units++;
+            }
+            if (!matched) {
+                file_list.pop_back();
+                return;
+            }
+            n_logical_id += unitCount(f->size);
+            n_files++;
+            if (info_callback) {
+                // opened as dedup source
+                info_callback(file_name, info);
+            }
+        });
+        LOG("  matched %" PRIu64 " %s of %zu files from hash index.\n", n_units, unit_size == block_size ? "blocks" : "units", n_files);
     }
     hash_storage.finishEmitRecord();
+    if (physical_order) {
+        // units are emitted out of order
+        std::sort(zero_ranges.begin(), zero_ranges.end());
+        size_t n = 0;
+        for (auto &r: zero_ranges) {
+            if (n > 0 && zero_ranges[n - 1].first + zero_ranges[n - 1].second == r.first) {
+                zero_ranges[n - 1].second += r.second;
+            } else {
+                zero_ranges[n++] = r;
+            }
+        }
+        zero_ranges.resize(n);
+    }
     physical_set.reset();
+    hash_cache.clear();
+
+    // reflinked files map the same extents
+    std::sort(extents.begin(), extents.end(), [](const auto &lhs, const auto &rhs) { return lhs.begin < rhs.begin; });
+    size_t n_extents = 0;
+    for (auto &e: extents) {
+        if (n_extents > 0 && e.begin < extents[n_extents - 1].end) {
+            auto &last = extents[n_extents - 1];
+            last.end = std::max(last.end, e.end);
+            last.shared = last.shared || e.shared;
+        } else {
+            extents[n_extents++] = e;
+        }
+    }
+    extents.resize(n_extents);
+    extents.shrink_to_fit();
+    if (hash_index) {
+        hash_index->save();
+        hash_index.reset();
+    }
 
     // group blocks respecting to ref_limit
-    uint64_t group_id = -1;
+    //   groups whose members already share one physical block are dropped from the plan
+    //   other groups are written to group_storage in group order, so step 2 only needs to merge them
+    std::vector<HashRecord> group;
     uint64_t group_hash;
-    uint64_t group_ref = 0;
-    hash_storage.iterateSortedRecordAndModifyHashInplace(true, [&](auto &record) {
-        if (group_id == -1 || group_ref >= ref_limit || record.hash_value != group_hash || unaligned_blocks.find(record.logical_id) != unaligned_blocks.end()) {
-            if (group_ref > 0) {
-                (group_ref > 1 ? shared_blocks : unique_blocks)++;
-            }
-            group_id = record.logical_id;
-            group_ref = 0;
+    auto flush_group = [&]() {
+        if (group.empty()) return;
+        // a unit from hash index is only a dedup source, listed members share its blocks
+        bool reference = group[0].logical_id >= reference_id_base;
+        if (reference && group.size() == 1) {
+            group.clear();
+            return;
+        }
+        bool deduped = group.size() > 1 && std::all_of(group.begin(), group.end(), [&](const auto &r) { return r.physical_id == group[0].physical_id; });
+        uint64_t data_size = unitLength(group[0].logical_id);
+        if (deduped) {
+            deduped_blocks++;
+            deduped_bytes += data_size;
+        } else if (group.size() > 1) {
+            shared_blocks++;
+            shared_bytes += data_size;
+        } else {
+            unique_blocks++;
+            unique_bytes += data_size;
+        }
+        if (!reference) {
+            planned_blocks += (data_size + block_size - 1) / block_size;
+        }
+
+        // with in-place source, members on the most common physical block stay
+        uint64_t staying = -1;
+        if (reference) {
+            staying = group[0].physical_id;
+        } else if (inplace_source && group.size() > 1 && !deduped) {
+            std::map<uint64_t, size_t> refs;
+            for (auto &r: group) {
+                refs[r.physical_id]++;
+            }
+            staying = std::max_element(refs.begin(), refs.end(), [](const auto &lhs, const auto &rhs) { return lhs.second < rhs.second; })->first;
+        }
+        for (auto &r: group) {
+            auto e = r.physical_id & SCATTERED_UNIT ? nullptr : findExtent(r.physical_id);
+            if (!e) continue;
+            if (group.size() == 1) {
+                e->kept++;
+                e->kept_bytes += data_size;
+            } else if (group.size() > 1 && !deduped && r.physical_id != staying) {
+                e->released++;
+            } else {
+                e->pinned++;
+            }
+        }
+        if (!deduped) {
+            for (auto &r: group) {
+                r.group_id = group[0].logical_id;
+                group_storage.emitRecord(r);
+            }
+        }
+        group.clear();
+    };
+    group_storage.sort_mem = hash_storage.sort_mem;
+    group_storage.stor_path = hash_storage.stor_path + ".group";
+    group_storage.reserved_mem = hash_storage.memoryUsed();
+    group_storage.comparator = [](const auto &lhs, const auto &rhs) {
+        return std::tie(lhs.group_id, lhs.logical_id) < std::tie(rhs.group_id, rhs.logical_id);
+    };
+    group_storage.beginEmitRecord();
+    hash_storage.iterateSortedRecord([&](const HashRecord &record) {
+        if (!group.empty() && record.hash_value == group_hash && record.logical_id >= reference_id_base) {
+            // one unit from hash index is enough
+            return;
+        }
+        // sub-block remainders aren't hashed, so they are never grouped
+        if (group.empty() || group.size() >= ref_limit || record.hash_value != group_hash || unitLength(record.logical_id) % block_size != 0) {
+            flush_group();
             group_hash = record.hash_value;
         }
-        group_ref++;
-        record.group_id = group_id;
-        hash_storage.writeRecordInplace(record);
-    }, [](){});
-    if (group_ref > 0) {
-        (group_ref > 1 ? shared_blocks : unique_blocks)++;
+        group.push_back(record);
+    });
+    flush_group();
+    group_storage.finishEmitRecord();
+    hash_storage.clear();
+
+    // an extent is freed by relocation only if dedup releases part of it, and everything left in it is relocated
+    //   shared extents may be kept alive by files not in list (e.g. snapshots)
+    for (auto &e: extents) {
+        e.relocate = e.released > 0 && e.kept > 0 && e.pinned == 0 && !e.shared;
+        if (e.relocate) {
+            relocate_units += e.kept;
+            relocate_unit_bytes += e.kept_bytes;
+            relocate_extent_blocks += e.end - e.begin;
+        }
     }
 }
 
-void DedupInstance::iterateGroups(std::function<void(std::vector<uint64_t/*logical_id*/> &group)> group_callback)
+void DedupInstance::elevatorOrder(std::vector<std::pair<uint64_t/*physical_id*/, size_t/*idx*/>> &order, uint64_t &head)
 {
-    std::vector<uint64_t> group;
+    // C-SCAN: ascending from head position, then wrap around to the lowest address
+    std::sort(order.begin(), order.end());
+    auto mid = std::lower_bound(order.begin(), order.end(), std::make_pair(head, (size_t) 0));
+    std::rotate(order.begin(), mid, order.end());
+    if (!order.empty()) {
+        head = order.back().first;
+    }
+}
 
-    hash_storage.comparator = [](const auto &lhs, const auto &rhs) {
-        return std::tie(lhs.group_id, lhs.logical_id) < std::tie(rhs.group_id, rhs.logical_id);
-    };
+void DedupInstance::iterateGroups(std::function<void(std::vector<uint64_t/*logical_id*/> &group, std::vector<uint64_t/*physical_id*/> &physical_ids)> group_callback)
+{
+    std::vector<uint64_t> group;
+    std::vector<uint64_t> physical_ids;
 
+    // runs are written in group order while grouping, only merging is needed
     uint64_t group_id = -1;
-    hash_storage.iterateSortedRecord(false, [&](const HashRecord &record) {
+    group_storage.iterateSortedRecord([&](const HashRecord &record) {
         if (record.group_id != group_id) {
-            group_callback(group);
+            if (!group.empty()) group_callback(group, physical_ids);
             group_id = record.group_id;
             group.clear();
+            physical_ids.clear();
         }
         group.push_back(record.logical_id);
+        physical_ids.push_back(record.physical_id);
     });
-    group_callback(group);
+    if (!group.empty()) group_callback(group, physical_ids);
 }
 
-void DedupInstance::submitDuplicate()
+void DedupInstance::submitGroups()
 {
+    // one pass over groups: duplicate groups are deduped, unique units relocated
+    //   groups come in logical order of their first member, so both runs and relocation ranges coalesce as before
+    std::mutex log_mtx;
     auto dump_group = [&](std::vector<uint64_t> &group) {
+        std::lock_guard<std::mutex> lock(log_mtx);
         LOG("=== BEGIN OF GROUP DUMP ===\n");
         for (auto logical_id: group) {
             auto f = getFileItemByLogicalID(logical_id);
-            uint64_t off = (logical_id - f->logical_id_base) * block_size;
+            uint64_t off = unitOffset(f, logical_id);
             LOG("%016" PRIX64 ": off %016" PRIX64 " file '%s'\n", logical_id, off, f->file_name.c_str());
         }
         LOG("=== END OF GROUP DUMP ===\n");
     };
 
-    uint64_t redirect_bytes = 0;
+    // counters are updated by workers
+    std::atomic<uint64_t> redirect_bytes = 0;
     uint64_t processed = 0;
     resetProgress();
     
-    iterateGroups([&](std::vector<uint64_t> &group){
-        if (group.size() < 2) return;
+    bool prefetch = prefetch_size > 0;
+    uint64_t n_ranges = 0;
+    std::atomic<uint64_t> inplace_ranges = 0;
+    std::atomic<uint64_t> fallback_ranges = 0;
 
-        if (shouldPrintProgress()) {
-            LOG("  progress: %3.0f%% (redirected %s of data)\n", 100.0 * processed / shared_blocks, HB(redirect_bytes));
+    // prefer the physical block most members already share, as they need no change, then the lowest physical address
+    auto choose_source = [&](const std::vector<uint64_t> &physical_ids) -> size_t {
+        std::map<uint64_t, size_t> refs;
+        for (auto physical_id: physical_ids) {
+            refs[physical_id]++;
         }
-        processed++;
-        
-        allocChunkBlock();
+        size_t source = 0;
+        for (size_t i = 1; i < physical_ids.size(); i++) {
+            auto key = [&](size_t k) { return std::make_tuple(!(physical_ids[k] & SCATTERED_UNIT), refs[physical_ids[k]], UINT64_MAX - physical_ids[k]); };
+            if (key(i) > key(source)) {
+                source = i;
+            }
+        }
+        return source;
+    };
+
+    // only the last group of a run may be a short unit, members of a group have the same length
+    auto run_length = [&](const std::vector<uint64_t> &run, uint64_t run_blocks) -> uint64_t {
+        return (run_blocks - 1) * unit_size + unitLength(run[0] + run_blocks - 1);
+    };
+
+    // dedup other members of a run directly against the chosen member, false if kernel rejects any of them
+    auto dedup_inplace = [&](Worker &w, std::vector<uint64_t> &run, uint64_t run_blocks, size_t source) -> bool {
+        uint64_t range_length = run_length(run, run_blocks);
+        auto src_f = getFileItemByLogicalID(run[source]);
+        uint64_t src_off = unitOffset(src_f, run[source]);
+        int src_fd = getFD(w, src_f);
+        if (src_fd < 0) return false;
+
+        std::vector<std::tuple<int, uint64_t, uint64_t>> dedup_buffer;
+        for (size_t i = 0; i < run.size(); i++) {
+            if (i == source) continue;
+            auto dest_f = getFileItemByLogicalID(run[i]);
+            int dest_fd = getFD(w, dest_f);
+            if (dest_fd >= 0) {
+                dedup_buffer.push_back(std::make_tuple(dest_fd, unitOffset(dest_f, run[i]), 0));
+            }
+        }
+        KernelInterface::dedupRange(src_fd, src_off, range_length, dedup_buffer, !prefetch);
+
+        bool success = true;
+        for (auto &[dest_fd, dest_offset, result]: dedup_buffer) {
+            success = success && result == range_length;
+            if (prefetch) {
+                KernelInterface::dropCache(dest_fd, dest_offset, range_length);
+            }
+        }
+        if (prefetch) {
+            KernelInterface::dropCache(src_fd, src_off, range_length);
+        }
+        if (success) {
+            redirect_bytes += dedup_buffer.size() * range_length;
+        }
+        return success;
+    };
+
+    // dedup a run of parallel groups: group k of the run is {run[i] + k}
+    //   data of all groups is copied to chunk store together, then each member is deduped as one range
+    //   called on workers
+    auto dedup_run = [&](Worker &w, std::vector<uint64_t> &run, uint64_t run_blocks, size_t source) {
+        if (inplace_source || run[source] >= reference_id_base) {
+            if (dedup_inplace(w, run, run_blocks, source)) {
+                inplace_ranges++;
+                return;
+            }
+            fallback_ranges++;
+        }
+
+        uint64_t range_length = run_length(run, run_blocks);
+        allocChunkRange(w, range_length);
         bool copy_success = false;
         
         // fill range buffer
         std::vector<std::tuple<int, uint64_t, uint64_t>> dedup_buffer;
-        for (auto logical_id: group) {
+        std::vector<uint64_t> members;
+        for (auto logical_id: run) {
             auto dest_f = getFileItemByLogicalID(logical_id);
-            uint64_t dest_off = (logical_id - dest_f->logical_id_base) * block_size;
+            uint64_t dest_off = unitOffset(dest_f, logical_id);
             
-            int dest_fd = getFD(dest_f);
+            int dest_fd = getFD(w, dest_f);
             if (dest_fd >= 0) {
                 if (!copy_success) {
-                    copy_success = KernelInterface::copyRange(tmp_fd, tmp_off, dest_fd, dest_off, block_size);
+                    copy_success = KernelInterface::copyRange(w.tmp_fd, w.tmp_off, dest_fd, dest_off, range_length, prefetch);
                 }
+                if (logical_id >= reference_id_base) continue; // only read
                 dedup_buffer.push_back(std::make_tuple(dest_fd, dest_off, 0));
+                members.push_back(logical_id);
             }
         }
 
         if (!copy_success) {
             LOG("warning: unable to copy group data\n");
-            dump_group(group);
+            dump_group(run);
             return;
         }
         
         // submit range
-        KernelInterface::dedupRange(tmp_fd, tmp_off, block_size, dedup_buffer);
+        KernelInterface::dedupRange(w.tmp_fd, w.tmp_off, range_length, dedup_buffer, !prefetch);
 
-        // check results
-        auto it = group.begin();
+        // check results, retry failed members block by block
+        auto it = members.begin();
         for (auto &[dest_fd, dest_offset, result]: dedup_buffer) {
             auto logical_id = *it++;
-            if (result == block_size) {
+            if (result == range_length) {
                 redirect_bytes += result;
             } else {
-                LOG("warning: unable to dedup %016" PRIX64 "\n", logical_id);
-                dump_group(group);
+                for (uint64_t k = 0; k < run_blocks; k++) {
+                    uint64_t length = std::min(unit_size, range_length - k * unit_size);
+                    std::vector<std::tuple<int, uint64_t, uint64_t>> block_buffer;
+                    block_buffer.push_back(std::make_tuple(dest_fd, dest_offset + k * unit_size, 0));
+                    if (run_blocks > 1) {
+                        KernelInterface::dedupRange(w.tmp_fd, w.tmp_off + k * unit_size, length, block_buffer, !prefetch);
+                    }
+                    if (std::get<2>(block_buffer[0]) == length) {
+                        redirect_bytes += length;
+                    } else {
+                        LOG("warning: unable to dedup %016" PRIX64 "\n", logical_id + k);
+                        std::vector<uint64_t> group;
+                        for (auto member: run) {
+                            group.push_back(member + k);
+                        }
+                        dump_group(group);
+                    }
+                }
+            }
+            if (prefetch) {
+                KernelInterface::dropCache(dest_fd, dest_offset, range_length);
             }
         }
-    });
+    };
 
-    LOG("successfully redirected %s of data.\n", HB(redirect_bytes));
-    
-}
+    // runs and ranges are handed to workers, jobs sharing a file never run at the same time
+    WorkerPool pool(workers.size());
+    auto submit_run = [&](std::vector<uint64_t> &run, uint64_t run_blocks, size_t source) {
+        processed += run_blocks;
+        n_ranges++;
 
-void DedupInstance::relocateUnique()
-{
-    uint64_t relocate_bytes = 0;
-    uint64_t processed = 0;
-    resetProgress();
+        std::vector<uint64_t> files;
+        for (auto logical_id: run) {
+            files.push_back(getFileItemByLogicalID(logical_id) - file_list.begin());
+        }
+        pool.submit(files, [&, run, run_blocks, source](int worker) mutable {
+            dedup_run(*workers[worker], run, run_blocks, source);
+        });
+    };
+
+    // with prefetch, readahead hints for a batch of runs are issued together
+    //   then data is read into page cache once, shared by copyRange and FIDEDUPERANGE
+    std::vector<std::tuple<std::vector<uint64_t>, uint64_t, size_t>> batch;
+    uint64_t batch_bytes = 0;
+    Worker hint_files; // files opened by this thread
+    auto flush_batch = [&]() {
+        std::vector<std::tuple<int, uint64_t, uint64_t>> ranges;
+        for (auto &[run, run_blocks, source]: batch) {
+            for (auto logical_id: run) {
+                auto f = getFileItemByLogicalID(logical_id);
+                int fd = getFD(hint_files, f);
+                if (fd >= 0) {
+                    ranges.push_back(std::make_tuple(fd, unitOffset(f, logical_id), run_length(run, run_blocks)));
+                }
+            }
+        }
+        KernelInterface::prefetchRanges(ranges);
+        for (auto &[run, run_blocks, source]: batch) {
+            submit_run(run, run_blocks, source);
+        }
+        batch.clear();
+        batch_bytes = 0;
+    };
 
-    uint64_t logical_id_base = -1;
-    std::string dest_fn;
-    int dest_fd = -1;
+    // coalesce adjacent groups into runs
+    //   groups come in order of their smallest logical_id, so a run continues with the very next group
+    auto queue_run = [&](std::vector<uint64_t> &run, uint64_t run_blocks, size_t source) {
+        if (!prefetch) {
+            submit_run(run, run_blocks, source);
+        } else {
+            batch.push_back(std::make_tuple(run, run_blocks, source));
+            batch_bytes += run.size() * run_length(run, run_blocks);
+            if (batch_bytes >= prefetch_size) {
+                flush_batch();
+            }
+        }
+    };
 
-    uint64_t chunk_offset;
-    uint64_t range_offset;
-    uint64_t range_length = 0;
-    auto flush_range = [&]() {
-        if (dest_fd == -1 || range_length == 0) return;
+    // with submit window, runs are reordered by physical address of the member data is read from
+    std::vector<std::tuple<std::vector<uint64_t>, uint64_t, size_t>> window;
+    std::vector<std::pair<uint64_t, size_t>> order;
+    uint64_t head = 0;
+    auto flush_window = [&]() {
+        elevatorOrder(order, head);
+        for (auto &[physical_id, i]: order) {
+            auto &[run, run_blocks, source] = window[i];
+            queue_run(run, run_blocks, source);
+        }
+        window.clear();
+        order.clear();
+    };
+
+    std::vector<uint64_t> run;
+    uint64_t run_blocks = 0;
+    size_t run_source = 0;
+    uint64_t run_physical_id = 0;
+    uint64_t max_run_blocks = std::max<uint64_t>(1, std::min(chunk_limit, MAX_DEDUP_LENGTH) / unit_size);
+    auto flush_run = [&]() {
+        if (run_blocks == 0) return;
+        if (submit_window == 0) {
+            queue_run(run, run_blocks, run_source);
+        } else {
+            order.push_back(std::make_pair(run_physical_id, window.size()));
+            window.push_back(std::make_tuple(run, run_blocks, run_source));
+            if (window.size() >= submit_window) {
+                flush_window();
+            }
+        }
+        run_blocks = 0;
+    };
+    auto extends_run = [&](const std::vector<uint64_t> &group) {
+        if (run_blocks == 0 || run_blocks >= max_run_blocks || group.size() != run.size()) return false;
+        for (size_t i = 0; i < group.size(); i++) {
+            // every member must stay in its file
+            if (group[i] != run[i] + run_blocks || getFileItemByLogicalID(group[i]) != getFileItemByLogicalID(run[i])) return false;
+        }
+        return true;
+    };
+
+    std::atomic<uint64_t> relocate_bytes = 0;
+    uint64_t relocated = 0;
+    uint64_t skipped = 0;
+    uint64_t skipped_bytes = 0;
+
+    // logically contiguous unique units of a file, copied to chunk store and deduped together
+    struct Range {
+        std::vector<FileItem>::iterator f;
+        uint64_t offset;
+        uint64_t length = 0;
+        uint64_t chunk_offset;
+        uint64_t physical_id; // of first unit, for scheduling
+    };
+    auto relocate_range = [&](Worker &w, const Range &r) {
+        int dest_fd = getFD(w, r.f);
+        if (dest_fd < 0) return;
+        allocChunkRange(w, r.chunk_offset + r.length);
+        KernelInterface::copyRange(w.tmp_fd, w.tmp_off + r.chunk_offset, dest_fd, r.offset, r.length);
         std::vector<std::tuple<int, uint64_t, uint64_t>> dedup_buffer;
-        dedup_buffer.push_back(std::make_tuple(dest_fd, range_offset, 0));
-        KernelInterface::dedupRange(tmp_fd, chunk_offset, range_length, dedup_buffer);
+        dedup_buffer.push_back(std::make_tuple(dest_fd, r.offset, 0));
+        KernelInterface::dedupRange(w.tmp_fd, w.tmp_off + r.chunk_offset, r.length, dedup_buffer);
         uint64_t result;
         std::tie(std::ignore, std::ignore, result) = dedup_buffer[0];
-        if (result == range_length) {
+        if (result == r.length) {
             relocate_bytes += result;
         } else {
-            LOG("warning: unable to relocate file '%s' offset %016" PRIX64 " length %016" PRIX64 "\n", dest_fn.c_str(), range_offset, range_length);
+            LOG("warning: unable to relocate file '%s' offset %016" PRIX64 " length %016" PRIX64 "\n", r.f->file_name.c_str(), r.offset, r.length);
         }
     };
 
-    iterateGroups([&](std::vector<uint64_t> &group){
-        if (group.size() != 1) return;
+    auto submit_range = [&](const Range &r) {
+        pool.submit({ (uint64_t) (r.f - file_list.begin()) }, [&, r](int worker) {
+            relocate_range(*workers[worker], r);
+        });
+    };
 
+    // with submit window, ranges are relocated in physical order
+    std::vector<Range> range_window;
+    uint64_t range_head = 0;
+    auto flush_range_window = [&]() {
+        std::vector<std::pair<uint64_t, size_t>> order;
+        for (size_t i = 0; i < range_window.size(); i++) {
+            order.push_back(std::make_pair(range_window[i].physical_id, i));
+        }
+        elevatorOrder(order, range_head);
+        for (auto &[physical_id, i]: order) {
+            submit_range(range_window[i]);
+        }
+        range_window.clear();
+    };
+
+    Range range;
+    auto flush_range = [&]() {
+        if (range.length == 0) return;
+        range_window.push_back(range);
+        if (range_window.size() >= std::max<uint64_t>(1, submit_window)) {
+            flush_range_window();
+        }
+        range.length = 0;
+    };
+
+    iterateGroups([&](std::vector<uint64_t> &group, std::vector<uint64_t> &physical_ids){
         if (shouldPrintProgress()) {
-            LOG("  progress: %3.0f%% (relocated %s of data)\n", 100.0 * processed / unique_blocks, HB(relocate_bytes));
+            LOG("  progress: %3.0f%% (redirected %s, relocated %s of data)\n", 100.0 * (processed + relocated) / (shared_blocks + unique_blocks), HB(redirect_bytes.load()), HB(relocate_bytes.load()));
         }
-        processed++;
 
-        uint64_t logical_id = group[0];
+        if (group.size() >= 2) {
+            if (!extends_run(group)) {
+                flush_run();
+                run = group;
+                // members are in logical order, a unit from hash index is the last one
+                run_source = group.back() >= reference_id_base ? group.size() - 1 : inplace_source ? choose_source(physical_ids) : 0;
+                run_physical_id = physical_ids[run_source];
+            }
+            run_blocks++;
 
-        auto dest_f = getFileItemByLogicalID(logical_id);
-        uint64_t dest_off = (logical_id - dest_f->logical_id_base) * block_size;
+        } else if (relocate_enable) {
+            relocated++;
+            uint64_t logical_id = group[0];
+            uint64_t data_size = unitLength(logical_id);
+            if (!relocate_all && !(physical_ids[0] & SCATTERED_UNIT)) {
+                // extent wouldn't be freed, unknown extents are relocated anyway
+                auto e = findExtent(physical_ids[0]);
+                if (e && !e->relocate) {
+                    skipped++;
+                    skipped_bytes += data_size;
+                    return;
+                }
+            }
 
-        auto it = unaligned_blocks.find(logical_id);
-        uint64_t data_size = it != unaligned_blocks.end() ? it->second : block_size;
-        
+            auto dest_f = getFileItemByLogicalID(logical_id);
+            uint64_t dest_off = unitOffset(dest_f, logical_id);
 
-        if (logical_id_base != dest_f->logical_id_base || dest_off != range_offset + range_length || range_length >= chunk_limit || range_length % block_size != 0) {
-            flush_range();
-            dest_fn = dest_f->file_name;
-            logical_id_base = dest_f->logical_id_base;
-            dest_fd = getFD(dest_f);
-            range_offset = dest_off;
-            chunk_offset = 0;
-            range_length = 0;
-            truncateChunkStore();
-            if (data_size != block_size) {
-                 // XXX: workaround strange error -95 on deduping small files;
-                 chunk_offset = block_size;
+            // a sub-block remainder ends its range
+            if (range.length == 0 || range.f != dest_f || dest_off != range.offset + range.length || range.length >= chunk_limit || range.length % block_size != 0) {
+                flush_range();
+                range.f = dest_f;
+                range.offset = dest_off;
+                range.chunk_offset = 0;
+                range.physical_id = physical_ids[0];
+                if (data_size % block_size != 0) {
+                     // XXX: workaround strange error -95 on deduping small files;
+                     range.chunk_offset = block_size;
+                }
             }
+            range.length += data_size;
         }
-
-        KernelInterface::copyRange(tmp_fd, chunk_offset + range_length, dest_fd, dest_off, data_size);
-        range_length += data_size;
     });
+    flush_run();
+    flush_window();
+    flush_batch();
     flush_range();
-    LOG("successfully relocated %s of data.\n", HB(relocate_bytes));
+    flush_range_window();
+    pool.wait();
+    closeWorker(hint_files);
+
+    LOG("successfully redirected %s of data.\n", HB(redirect_bytes.load()));
+    LOG("submitted %" PRIu64 " groups as %" PRIu64 " ranges.\n", processed, n_ranges);
+    if (inplace_source) {
+        LOG("deduped %" PRIu64 " ranges in place, %" PRIu64 " fell back to chunk store.\n", inplace_ranges.load(), fallback_ranges.load());
+    }
+    LOG("skipped %" PRIu64 " groups already deduplicated (%s).\n", deduped_blocks, HB(deduped_bytes));
+    if (relocate_enable) {
+        LOG("successfully relocated %s of data.\n", HB(relocate_bytes.load()));
+        LOG("skipped %" PRIu64 " %s in extents not freed by relocation (%s).\n", skipped, unit_size == block_size ? "blocks" : "units", HB(skipped_bytes));
+    }
 }
 
-void DedupInstance::truncateChunkStore()
+void DedupInstance::submitWholeFiles()
 {
-    KernelInterface::closeFD(tmp_fd);
-    tmp_fd = KernelInterface::openFD(chunk_file, O_RDWR | O_CREAT | O_TRUNC);
-    if (tmp_fd < 0) {
+    // after block dedup, every ref_limit files are deduped against the first of them, so the group shares the representative's final extents
+    //   pieces the kernel rejects are copied to chunk store and deduped again, with the source; the tail piece ends at EOF of both files
+    uint64_t redirect_bytes = 0;
+    uint64_t processed = 0;
+    uint64_t piece_limit = std::max(block_size, std::min(chunk_limit, MAX_DEDUP_LENGTH) / block_size * block_size);
+    auto &w = *workers[0];
+    resetProgress();
+
+    for (auto &[size, group]: whole_groups) {
+        if (shouldPrintProgress()) {
+            LOG("  progress: %3.0f%% (redirected %s of data)\n", 100.0 * processed / whole_groups.size(), HB(redirect_bytes));
+        }
+        processed++;
+
+        for (size_t begin = 0; begin < group.size(); begin += ref_limit) {
+            int src_fd = KernelInterface::openFD(group[begin]);
+            if (src_fd < 0) continue;
+            std::vector<std::tuple<int, uint64_t, uint64_t>> targets;
+            std::vector<std::string> names;
+            for (size_t i = begin + 1; i < std::min(begin + ref_limit, group.size()); i++) {
+                int fd = KernelInterface::openFD(group[i]);
+                if (fd >= 0) {
+                    targets.push_back(std::make_tuple(fd, 0, 0));
+                    names.push_back(group[i]);
+                }
+            }
+
+            for (uint64_t off = 0; !targets.empty() && off < size; off += piece_limit) {
+                uint64_t length = std::min(piece_limit, size - off);
+                for (auto &[fd, dest_off, result]: targets) {
+                    dest_off = off;
+                    result = 0;
+                }
+                KernelInterface::dedupRange(src_fd, off, length, targets);
+
+                std::vector<std::tuple<int, uint64_t, uint64_t>> retry;
+                std::vector<std::string> retry_names;
+                for (size_t i = 0; i < targets.size(); i++) {
+                    if (std::get<2>(targets[i]) == length) {
+                        redirect_bytes += length;
+                    } else {
+                        retry.push_back(std::make_tuple(std::get<0>(targets[i]), off, 0));
+                        retry_names.push_back(names[i]);
+                    }
+                }
+                if (retry.empty()) continue;
+                retry.push_back(std::make_tuple(src_fd, off, 0));
+                retry_names.push_back(group[begin]);
+
+                uint64_t chunk_offset = 0;
+                if (length < block_size) {
+                    // XXX: workaround strange error -95 on deduping small files;
+                    chunk_offset = block_size;
+                }
+                allocChunkRange(w, chunk_offset + length);
+                chunk_offset += w.tmp_off;
+                if (!KernelInterface::copyRange(w.tmp_fd, chunk_offset, src_fd, off, length)) {
+                    LOG("warning: unable to copy data of file '%s'\n", group[begin].c_str());
+                    continue;
+                }
+                KernelInterface::dedupRange(w.tmp_fd, chunk_offset, length, retry);
+                for (size_t i = 0; i < retry.size(); i++) {
+                    if (std::get<2>(retry[i]) == length) {
+                        redirect_bytes += length;
+                    } else {
+                        LOG("warning: unable to dedup file '%s' offset %016" PRIX64 " length %016" PRIX64 "\n", retry_names[i].c_str(), off, length);
+                    }
+                }
+            }
+
+            for (auto &[fd, dest_off, result]: targets) {
+                KernelInterface::closeFD(fd);
+            }
+            KernelInterface::closeFD(src_fd);
+        }
+    }
+
+    LOG("successfully redirected %s of data in whole files.\n", HB(redirect_bytes));
+}
+
+void DedupInstance::punchZeros()
+{
+    // zero ranges are deduped against a sparse file, the kernel checks they are still zero before mapping the hole
+    std::string zero_file = chunk_file + ".zero";
+    int hole_fd = KernelInterface::openFD(zero_file, O_RDWR | O_CREAT | O_TRUNC);
+    if (hole_fd < 0 || !KernelInterface::setFileSize(hole_fd, MAX_DEDUP_LENGTH)) {
+        LOG("warning: unable to create sparse file '%s', zero blocks not punched.\n", zero_file.c_str());
+        if (hole_fd >= 0) {
+            KernelInterface::closeFD(hole_fd);
+            remove(zero_file.c_str());
+        }
+        return;
+    }
+
+    uint64_t punched_bytes = 0;
+    uint64_t processed = 0;
+    resetProgress();
+
+    for (auto [logical_id, count]: zero_ranges) {
+        while (count > 0) {
+            if (shouldPrintProgress()) {
+                LOG("  progress: %3.0f%% (punched %s of data)\n", 100.0 * processed / zero_blocks, HB(punched_bytes));
+            }
+
+            // split at file boundaries, skip units of files which failed later
+            auto f = getFileItemByLogicalID(logical_id);
+            uint64_t file_end = f->logical_id_base + unitCount(f->size);
+            if (logical_id >= file_end) {
+                logical_id++;
+                count--;
+                processed++;
+                continue;
+            }
+            uint64_t n = std::min(count, file_end - logical_id);
+            uint64_t off = unitOffset(f, logical_id);
+            int fd = getFD(*workers[0], f);
+            if (fd >= 0) {
+                uint64_t punched = KernelInterface::dedupToHole(hole_fd, MAX_DEDUP_LENGTH, fd, off, n * unit_size);
+                if (punched != n * unit_size) {
+                    LOG("warning: unable to punch file '%s' offset %016" PRIX64 " length %016" PRIX64 " (%s punched)\n", f->file_name.c_str(), off, n * unit_size, HB(punched));
+                }
+                punched_bytes += punched;
+            }
+            logical_id += n;
+            count -= n;
+            processed += n;
+        }
+    }
+
+    KernelInterface::closeFD(hole_fd);
+    remove(zero_file.c_str());
+    LOG("successfully punched %s of zero data.\n", HB(punched_bytes));
+}
+
+void DedupInstance::initWorkers()
+{
+    // worker 0 uses chunk_file itself
+    for (int i = 0; i < std::max(1, dedup_threads); i++) {
+        auto w = std::make_unique<Worker>();
+        w->chunk_file = i == 0 ? chunk_file : chunk_file + "." + std::to_string(i);
+        workers.push_back(std::move(w));
+    }
+}
+void DedupInstance::closeWorker(Worker &w)
+{
+    for (auto &[f, fd]: w.opened_file) {
+        KernelInterface::closeFD(fd);
+    }
+    w.opened_file.clear();
+    w.opened_it.clear();
+    if (w.tmp_fd >= 0) {
+        KernelInterface::closeFD(w.tmp_fd);
+        w.tmp_fd = -1;
+        remove(w.chunk_file.c_str());
+    }
+}
+void DedupInstance::closeWorkers()
+{
+    for (auto &w: workers) {
+        closeWorker(*w);
+    }
+    workers.clear();
+}
+
+void DedupInstance::openChunkStore(Worker &w)
+{
+    // created and preallocated once, then reused by offset
+    //   overwriting data already deduped only replaces extents of chunk store itself (copy-on-write)
+    if (w.tmp_fd >= 0) return;
+    w.tmp_fd = KernelInterface::openFD(w.chunk_file, O_RDWR | O_CREAT | O_TRUNC);
+    if (w.tmp_fd < 0) {
         LOG("unable to create chunk storage.\n");
     }
-    VERIFY(tmp_fd >= 0);
+    VERIFY(w.tmp_fd >= 0);
+    KernelInterface::preallocate(w.tmp_fd, chunk_limit + block_size);
 }
-void DedupInstance::allocChunkBlock()
+void DedupInstance::allocChunkRange(Worker &w, uint64_t length)
 {
-    tmp_off += block_size;
-    if (tmp_fd < 0 || tmp_off >= chunk_limit) {
-        truncateChunkStore();
-        tmp_off = 0;
+    openChunkStore(w);
+    if (length % block_size == 0) {
+        w.ring_off += w.ring_len;
+        w.ring_len = length;
+        if (w.ring_off + w.ring_len > chunk_limit) {
+            w.ring_off = 0;
+        }
+        w.ring_end = std::max(w.ring_end, w.ring_off + w.ring_len);
+        w.tmp_off = w.ring_off;
+        return;
+    }
+
+    // unaligned range must end at EOF of both files
+    //   it is appended after everything else, so writing its data moves EOF there without truncating
+    //   once the tail area grows as large as the ring, it is cut off (preallocated ring is kept)
+    uint64_t tail_begin = (std::max(chunk_limit, w.ring_end) + block_size - 1) / block_size * block_size;
+    if (w.tail_end > tail_begin + chunk_limit) {
+        KernelInterface::setFileSize(w.tmp_fd, tail_begin);
+        w.tail_end = 0;
     }
-    VERIFY(tmp_fd >= 0);
+    w.tmp_off = (std::max(tail_begin, w.tail_end) + block_size - 1) / block_size * block_size;
+    w.tail_end = w.tmp_off + length;
 }
 
 void DedupInstance::resetProgress()
@@ -317,6 +1497,15 @@ bool DedupInstance::shouldPrintProgress()
 
 void DedupInstance::doDedup()
 {
+    if (unit_size == 0) {
+        unit_size = block_size;
+    }
+    VERIFY(unit_size % block_size == 0);
+    const char *unit_name = unit_size == block_size ? "blocks" : "units";
+
+    // data written since last run (e.g. last daemon cycle) may still be delayed allocated
+    KernelInterface::resetSyncedFileSystems();
+
     LOG("step 1: hash files & group blocks ...\n");
     hashFiles();
     LOG("\n");
@@ -325,31 +1514,49 @@ void DedupInstance::doDedup()
     LOG("  physical blocks: %" PRIu64 " (%s)\n", physical_blocks, HB(physical_blocks * block_size));
     LOG("  ignored blocks: %" PRIu64 " (%s)\n", ignored_blocks, HB(ignored_blocks * block_size));
     LOG("  hased blocks: %" PRIu64 " (%s)\n", hashed_blocks, HB(hashed_blocks * block_size));
-    LOG("  shared blocks: %" PRIu64 " (%s)\n", shared_blocks, HB(shared_blocks * block_size));
-    LOG("  unique blocks: %" PRIu64 " (%s)\n", unique_blocks, HB(unique_blocks * block_size));
+    LOG("  reflinked blocks (not read again): %" PRIu64 " (%s)\n", reused_blocks, HB(reused_blocks * block_size));
+    LOG("  unchanged blocks (from hash index): %" PRIu64 " (%s)\n", unchanged_blocks, HB(unchanged_blocks * block_size));
+    LOG("  checksum-unique blocks (not read): %" PRIu64 " (%s)\n", csum_blocks, HB(csum_blocks * block_size));
+    LOG("  shared %s: %" PRIu64 " (%s)\n", unit_name, shared_blocks, HB(shared_bytes));
+    LOG("  unique %s: %" PRIu64 " (%s)\n", unit_name, unique_blocks, HB(unique_bytes));
+    LOG("  already deduped %s: %" PRIu64 " (%s)\n", unit_name, deduped_blocks, HB(deduped_bytes));
+    if (punch_zero) {
+        LOG("  zero %s (to punch): %" PRIu64 " (%s)\n", unit_name, zero_blocks, HB(zero_blocks * unit_size));
+    }
+    if (whole_file) {
+        LOG("  whole-file duplicates: %" PRIu64 " files, %zu groups to dedup (%s redundant)\n", whole_files, whole_groups.size(), HB(whole_file_bytes));
+    }
     LOG("\n");
 
-    uint64_t before_dedup = physical_blocks;
-    uint64_t after_dedup = shared_blocks + unique_blocks;
-    uint64_t delta = before_dedup - after_dedup;
+    uint64_t before_dedup = physical_blocks + whole_before_blocks;
+    uint64_t after_dedup = planned_blocks + whole_after_blocks;
+    uint64_t delta = before_dedup > after_dedup ? before_dedup - after_dedup : 0;
     LOG("dedup plan:\n");
     LOG("  before dedup: %" PRIu64 " (%s)\n", before_dedup, HB(before_dedup * block_size));
     LOG("  after dedup: %" PRIu64 " (%s)\n", after_dedup, HB(after_dedup * block_size));
     LOG("  delta: %" PRIu64 " (%s)\n", delta, HB(delta * block_size));
     LOG("\n");
 
-    if (dedup_enable) {
-        LOG("step 2: submit duplicate ranges to kernel ...\n");
-        submitDuplicate();
+    if (relocate_enable && !relocate_all) {
+        LOG("relocation plan:\n");
+        LOG("  %s to relocate: %" PRIu64 " (%s written)\n", unit_name, relocate_units, HB(relocate_unit_bytes));
+        LOG("  extents freed: %s\n", HB(relocate_extent_blocks * block_size));
         LOG("\n");
+    }
 
-        if (relocate_enable) {
-            LOG("step 3: relocate unique blocks ...\n");
-            relocateUnique();
-            LOG("\n");
+    if (dedup_enable) {
+        initWorkers();
+        LOG("step 2: submit duplicate ranges to kernel%s ...\n", relocate_enable ? ", relocate unique blocks" : "");
+        if (!zero_ranges.empty()) {
+            punchZeros();
         }
+        submitGroups();
+        if (!whole_groups.empty()) {
+            submitWholeFiles();
+        }
+        LOG("\n");
 
-        remove(chunk_file.c_str());
+        closeWorkers();
     }
 
     LOG("finished!\n");
@@ -2,17 +2,21 @@
 
 #include "BitVector.h"
 #include "HashStorage.h"
+#include "HashCache.h"
+#include "HashIndex.h"
+#include "HashPipeline.h"
 #include "KernelInterface.h"
 
 class DedupInstance {
+    static constexpr uint64_t MAX_DEDUP_LENGTH = 16 * 1048576; // btrfs limit of a single FIDEDUPERANGE
+    static const uint64_t SCATTERED_UNIT = 1ULL << 63; // physical_id flag, blocks of unit aren't physically contiguous or have no physical address
+    static const uint64_t CSUM_HASH_SEED = 0x6373756d; // seed of hashes derived from btrfs checksums
+
     struct FileItem {
         std::string file_name;
         uint64_t size = 0;
         uint64_t logical_id_base = 0;
-
-        int fd = -1;
-
-        std::any opened_it; // opened_file::iterator
+        bool indexed = false; // hash index entry already written
 
         FileItem() {}
         FileItem(const std::string &_file_name) : file_name(_file_name) {}
@@ -24,26 +28,88 @@ class DedupInstance {
     
     std::vector<FileItem> file_list;
 
+    // physically contiguous range of blocks, as seen by FIEMAP while hashing
+    //   relocating unique units of an extent only frees space if nothing else keeps the extent alive
+    struct Extent {
+        uint64_t begin; // physical_id
+        uint64_t end;
+        bool shared; // FIEMAP_EXTENT_SHARED, may be referenced by files not in list
+        uint64_t released = 0; // units of duplicate groups, redirected elsewhere
+        uint64_t kept = 0; // unique units, may be relocated
+        uint64_t kept_bytes = 0;
+        uint64_t pinned = 0; // units staying where they are
+        bool relocate = false;
+    };
+    std::vector<Extent> extents; // sorted by begin, disjoint
+
     uint64_t n_logical_id = 0;
+    uint64_t reference_id_base = UINT64_MAX; // first logical_id of files matched from hash index, they are only read as dedup source
 
     uint64_t physical_blocks = 0;
     uint64_t ignored_blocks = 0;
     uint64_t hashed_blocks = 0;
+    uint64_t reused_blocks = 0;
+    uint64_t unchanged_blocks = 0;
+    uint64_t csum_blocks = 0;
     uint64_t shared_blocks = 0;
     uint64_t unique_blocks = 0;
+    uint64_t deduped_blocks = 0; // groups already sharing one physical block
+    uint64_t shared_bytes = 0; // data size of the groups counted above
+    uint64_t unique_bytes = 0;
+    uint64_t deduped_bytes = 0;
+    uint64_t planned_blocks = 0; // blocks of all groups, i.e. blocks after dedup
+    uint64_t relocate_units = 0; // unique units in extents freed by relocation
+    uint64_t relocate_unit_bytes = 0;
+    uint64_t relocate_extent_blocks = 0;
+    uint64_t zero_blocks = 0; // all-zero units, punched instead of deduped
+    uint64_t whole_files = 0; // files with whole-file duplicates, left out of block hashing
+    uint64_t whole_file_bytes = 0;
+    uint64_t whole_before_blocks = 0;
+    uint64_t whole_after_blocks = 0;
+
+    std::vector<std::pair<uint64_t/*logical_id*/, uint64_t/*count*/>> zero_ranges; // adjacent zero units, may span files
+    std::vector<std::pair<uint64_t/*size*/, std::vector<std::string>/*files*/>> whole_groups; // identical files to dedup, first one is in block hashing
+
+    // state of a thread submitting ranges in step 2
+    struct Worker {
+        std::string chunk_file;
+        int tmp_fd = -1;
+        uint64_t tmp_off = 0; // offset of last allocated range
+        uint64_t ring_off = 0; // aligned ranges are reused in [0, chunk_limit)
+        uint64_t ring_len = 0; // length of last aligned range at ring_off
+        uint64_t ring_end = 0; // highest end of aligned ranges
+        uint64_t tail_end = 0; // unaligned ranges are appended after the ring, 0 if none
+
+        std::list<std::pair<const FileItem *, int/*fd*/>> opened_file; // most recently used first, at most ref_limit
+        std::unordered_map<const FileItem *, std::list<std::pair<const FileItem *, int>>::iterator> opened_it;
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    HashStorage group_storage; // records of groups needing work, keyed by group_id (logical_id of first member)
 
-    std::list<std::vector<FileItem>::iterator> opened_file;
+    std::vector<uint64_t> csum_collisions; // sorted btrfs checksum keys shared by different physical blocks
 
-    int getFD(std::vector<FileItem>::iterator f);
+    int getFD(Worker &w, std::vector<FileItem>::iterator f);
     std::vector<FileItem>::iterator getFileItemByLogicalID(uint64_t logical_id);
+    uint64_t unitCount(uint64_t file_size);
+    uint64_t unitOffset(std::vector<FileItem>::iterator f, uint64_t logical_id);
+    uint64_t unitLength(uint64_t logical_id);
+    Extent *findExtent(uint64_t physical_id);
 
+    void findWholeFiles(std::function<HashLookup(size_t file_idx, const FileInfo &info)> make_lookup);
+    void findCsumCollisions();
     void hashFiles();
-    void iterateGroups(std::function<void(std::vector<uint64_t/*logical_id*/> &group)> group_callback);
-    void submitDuplicate();
-    void relocateUnique();
-
-    void truncateChunkStore();
-    void allocChunkBlock();
+    static void elevatorOrder(std::vector<std::pair<uint64_t/*physical_id*/, size_t/*idx*/>> &order, uint64_t &head);
+    void iterateGroups(std::function<void(std::vector<uint64_t/*logical_id*/> &group, std::vector<uint64_t/*physical_id*/> &physical_ids)> group_callback);
+    void submitGroups();
+    void submitWholeFiles();
+    void punchZeros();
+
+    void initWorkers();
+    void closeWorker(Worker &w);
+    void closeWorkers();
+    void openChunkStore(Worker &w);
+    void allocChunkRange(Worker &w, uint64_t length);
 
     void resetProgress();
     bool shouldPrintProgress();
@@ -52,22 +118,39 @@ public:
     ~DedupInstance();
 
     HashStorage hash_storage;
+    HashCache hash_cache;
+    std::unique_ptr<HashIndex> hash_index;
 
     std::string chunk_file = "chunkstorage.tmp";
+    std::string hash_index_file; // persistent hash index, disabled if empty
     uint64_t block_size = 4096; // fs block size
+    uint64_t unit_size = 0; // dedup granularity, multiple of block_size (0 for block_size)
     uint64_t ref_limit = 500; // max reference to a single block
+    int hash_threads = 1; // threads for hashing files
+    int dedup_threads = 1; // threads submitting ranges to kernel in step 2, each with its own chunk store
+    bool physical_order = false; // read blocks in physical order
+    uint64_t order_window = 65536; // max files scheduled together in physical order
+    uint64_t submit_window = 0; // max ranges reordered by physical address in step 2, 0 to keep logical order
+    bool index_files = false; // also match listed files against all files in hash index, without mapping them
+    bool btrfs_csum = false; // only read blocks whose btrfs checksums collide
+    bool whole_file = false; // dedup identical files as a whole
+    bool punch_zero = false; // punch holes for all-zero units instead of deduping them
+    bool relocate_all = false; // relocate all unique units, even if no extent is freed
+    bool inplace_source = false; // dedup groups against one of their members, chunk store only as fallback
+
+    std::function<void(const std::string &file_name, const FileInfo &info)> info_callback; // called for each mapped file, optional
+
+    std::unordered_map<uint64_t, uint64_t> unaligned_blocks; // data size of units shorter than unit_size, i.e. file tails
 
-    std::unordered_map<uint64_t, uint64_t> unaligned_blocks;
-
-    int tmp_fd = -1;
-    uint64_t tmp_off = 0;
     uint64_t chunk_limit = 16 * 1048576;
+    uint64_t prefetch_size = 0; // bytes of duplicate data prefetched together in step 2, 0 to preload with reads
 
     bool relocate_enable = true;
     bool dedup_enable = true;
 
     time_t next_progress;
 
+    void copyOptions(const DedupInstance &other);
     void addFile(const std::string &file_name);
     void doDedup();
 };
\ No newline at end of file
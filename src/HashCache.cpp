@@ -0,0 +1,35 @@
+#include "config.h"
+
+#include <linux/fiemap.h>
+
+#include "HashCache.h"
+
+bool HashCache::cacheable(uint32_t extent_flags)
+{
+    // physical offsets inside encoded (e.g. compressed) extents don't identify the data
+    return (extent_flags & FIEMAP_EXTENT_SHARED) && !(extent_flags & (FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC));
+}
+
+bool HashCache::get(uint64_t physical_id, uint64_t &hash_value)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = cache.find(physical_id);
+    if (it == cache.end()) return false;
+    hash_value = it->second;
+    return true;
+}
+void HashCache::put(uint64_t physical_id, uint64_t hash_value)
+{
+    if (max_entries == 0) return;
+    std::lock_guard<std::mutex> lock(mtx);
+    if (cache.size() >= max_entries) {
+        // recently seen extents are most likely to be seen again (e.g. snapshots walked in order)
+        std::unordered_map<uint64_t, uint64_t>().swap(cache);
+    }
+    cache[physical_id] = hash_value;
+}
+void HashCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    std::unordered_map<uint64_t, uint64_t>().swap(cache);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <mutex>
+
+// hashes of shared (reflinked) physical blocks, so they are read only once
+//   thread-safe, cleared when full
+class HashCache {
+    std::mutex mtx;
+    std::unordered_map<uint64_t/*physical_id*/, uint64_t/*hash_value*/> cache;
+
+public:
+    uint64_t max_entries = 4194304;
+
+    static bool cacheable(uint32_t extent_flags); // shared and not encoded
+
+    bool get(uint64_t physical_id, uint64_t &hash_value);
+    void put(uint64_t physical_id, uint64_t hash_value);
+    void clear();
+};
@@ -0,0 +1,194 @@
+#include "config.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "HashIndex.h"
+
+// file layout:
+//   magic, block_size
+//   file entries: name, dev, ino, size, mtime, ctime, blocks (idx + 1, hash) ..., 0
+//   table: count, (dev, ino, offset) ...
+//   table offset
+static const uint64_t INDEX_MAGIC = 0x3130304458444453ULL; // "SDDXD001"
+
+std::string HashIndex::newPath()
+{
+    return index_path + ".new";
+}
+
+bool HashIndex::readHeader(IntReader &reader, std::string &file_name, FileInfo &info)
+{
+    uint64_t name_len = reader.readZippedInt();
+    file_name.clear();
+    for (uint64_t i = 0; i < name_len && !reader.eofOccured(); i++) {
+        file_name.push_back(reader.readByte());
+    }
+    info.dev = reader.readZippedInt();
+    info.ino = reader.readZippedInt();
+    info.size = reader.readZippedInt();
+    info.mtime_ns = reader.readZippedInt();
+    info.ctime_ns = reader.readZippedInt();
+    return !reader.eofOccured();
+}
+void HashIndex::writeHeader(const std::string &file_name, const FileInfo &info)
+{
+    written.push_back(std::make_tuple(info.dev, info.ino, writer->tell()));
+    writer->writeZippedInt(file_name.size());
+    for (char ch: file_name) {
+        writer->writeByte(ch);
+    }
+    writer->writeZippedInt(info.dev);
+    writer->writeZippedInt(info.ino);
+    writer->writeZippedInt(info.size);
+    writer->writeZippedInt(info.mtime_ns);
+    writer->writeZippedInt(info.ctime_ns);
+}
+
+void HashIndex::load()
+{
+    entries.clear();
+    written.clear();
+    visited.clear();
+
+    if (access(index_path.c_str(), F_OK) == 0) {
+        IntReader reader(index_path);
+        uint64_t length = reader.length();
+        if (length >= 16 && reader.readInt() == INDEX_MAGIC && reader.readZippedInt() == block_size) {
+            reader.seek(length - 8);
+            reader.seek(reader.readInt());
+            uint64_t count = reader.readZippedInt();
+            for (uint64_t i = 0; i < count && !reader.eofOccured(); i++) {
+                uint64_t dev = reader.readZippedInt();
+                uint64_t ino = reader.readZippedInt();
+                uint64_t offset = reader.readZippedInt();
+                entries[std::make_pair(dev, ino)] = offset;
+            }
+            LOG("  loaded hash index '%s' (%zu files).\n", index_path.c_str(), entries.size());
+        } else {
+            LOG("warning: hash index '%s' is invalid or has different block size, ignored.\n", index_path.c_str());
+            entries.clear();
+        }
+    }
+
+    writer = std::make_unique<IntWriter>(newPath());
+    writer->writeInt(INDEX_MAGIC);
+    writer->writeZippedInt(block_size);
+}
+
+void HashIndex::forEachFile(std::function<void(const std::string &file_name, const FileInfo &info)> callback)
+{
+    if (entries.empty()) return;
+    IntReader reader(index_path);
+    for (auto &[key, offset]: entries) {
+        std::string file_name;
+        FileInfo info;
+        reader.seek(offset);
+        if (readHeader(reader, file_name, info)) {
+            callback(file_name, info);
+        }
+    }
+}
+
+std::unique_ptr<HashIndex::Cursor> HashIndex::open(const FileInfo &info)
+{
+    auto it = entries.find(std::make_pair(info.dev, info.ino));
+    if (it == entries.end()) return nullptr;
+    auto cursor = std::make_unique<Cursor>(index_path, it->second);
+    if (!cursor->valid(info)) return nullptr;
+    return cursor;
+}
+
+HashIndex::Cursor::Cursor(const std::string &index_path, uint64_t offset) : reader(index_path)
+{
+    reader.seek(offset);
+}
+bool HashIndex::Cursor::valid(const FileInfo &info)
+{
+    std::string file_name;
+    FileInfo old;
+    if (!readHeader(reader, file_name, old)) return false;
+    blocks_offset = reader.tell();
+    return old.dev == info.dev && old.ino == info.ino && old.size == info.size && old.mtime_ns == info.mtime_ns && old.ctime_ns == info.ctime_ns;
+}
+bool HashIndex::Cursor::lookup(uint64_t block_idx, uint64_t &hash_value)
+{
+    if (block_idx < last_idx) {
+        // out of order, restart from first block
+        reader.seek(blocks_offset);
+        have = end = false;
+    }
+    last_idx = block_idx;
+    while (!end && (!have || cur_idx < block_idx)) {
+        uint64_t v = reader.readZippedInt();
+        if (v == 0 || reader.eofOccured()) {
+            have = false;
+            end = true;
+            break;
+        }
+        cur_idx = v - 1;
+        cur_hash = reader.readInt();
+        have = true;
+    }
+    if (have && cur_idx == block_idx) {
+        hash_value = cur_hash;
+        return true;
+    }
+    return false;
+}
+
+void HashIndex::beginFile(const std::string &file_name, const FileInfo &info)
+{
+    visited.insert(std::make_pair(info.dev, info.ino));
+    writeHeader(file_name, info);
+}
+void HashIndex::addBlock(uint64_t block_idx, uint64_t hash_value)
+{
+    writer->writeZippedInt(block_idx + 1);
+    writer->writeInt(hash_value);
+}
+void HashIndex::finishFile()
+{
+    writer->writeZippedInt(0);
+}
+
+void HashIndex::save()
+{
+    // carry over files not seen in this run, if they still exist
+    uint64_t carried = 0;
+    if (!entries.empty()) {
+        IntReader reader(index_path);
+        for (auto &[key, offset]: entries) {
+            if (visited.find(key) != visited.end()) continue;
+            std::string file_name;
+            FileInfo info;
+            struct stat sb;
+            reader.seek(offset);
+            if (!readHeader(reader, file_name, info)) continue;
+            if (lstat(file_name.c_str(), &sb) == -1 || sb.st_dev != info.dev || sb.st_ino != info.ino) continue;
+            writeHeader(file_name, info);
+            while (1) {
+                uint64_t v = reader.readZippedInt();
+                if (v == 0 || reader.eofOccured()) break;
+                writer->writeZippedInt(v);
+                writer->writeInt(reader.readInt());
+            }
+            writer->writeZippedInt(0);
+            carried++;
+        }
+    }
+
+    uint64_t table_offset = writer->tell();
+    writer->writeZippedInt(written.size());
+    for (auto &[dev, ino, offset]: written) {
+        writer->writeZippedInt(dev);
+        writer->writeZippedInt(ino);
+        writer->writeZippedInt(offset);
+    }
+    writer->writeInt(table_offset);
+    writer->flush();
+    writer.reset();
+
+    VERIFY(rename(newPath().c_str(), index_path.c_str()) == 0);
+    LOG("  saved hash index '%s' (%zu files, %" PRIu64 " carried over).\n", index_path.c_str(), written.size(), carried);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "IntWriter.h"
+#include "IntReader.h"
+#include "KernelInterface.h"
+
+// persistent block hashes of files from previous runs
+//   a file is unchanged if dev, ino, size, mtime and ctime are all the same
+//   FIDEDUPERANGE and extent relocation don't change any of them
+class HashIndex {
+    std::string index_path;
+    uint64_t block_size;
+
+    std::map<std::pair<uint64_t/*dev*/, uint64_t/*ino*/>, uint64_t/*offset*/> entries;
+
+    std::unique_ptr<IntWriter> writer;
+    std::vector<std::tuple<uint64_t/*dev*/, uint64_t/*ino*/, uint64_t/*offset*/>> written;
+    std::set<std::pair<uint64_t, uint64_t>> visited;
+
+    std::string newPath();
+    static bool readHeader(IntReader &reader, std::string &file_name, FileInfo &info);
+    void writeHeader(const std::string &file_name, const FileInfo &info);
+
+public:
+    class Cursor {
+        IntReader reader;
+        uint64_t blocks_offset;
+        uint64_t last_idx = 0;
+        bool have = false;
+        bool end = false;
+        uint64_t cur_idx;
+        uint64_t cur_hash;
+
+    public:
+        Cursor(const std::string &index_path, uint64_t offset);
+        bool valid(const FileInfo &info);
+        bool lookup(uint64_t block_idx, uint64_t &hash_value); // best with ascending block_idx
+    };
+
+    HashIndex(const std::string &_index_path, uint64_t _block_size) : index_path(_index_path), block_size(_block_size) {}
+
+    void load();
+    void forEachFile(std::function<void(const std::string &file_name, const FileInfo &info)> callback);
+    std::unique_ptr<Cursor> open(const FileInfo &info); // thread-safe, nullptr if not found or changed
+
+    void beginFile(const std::string &file_name, const FileInfo &info);
+    void addBlock(uint64_t block_idx, uint64_t hash_value);
+    void finishFile();
+    void save();
+};
@@ -0,0 +1,197 @@
+#include "config.h"
+
+#include "HashPipeline.h"
+#include "KernelInterface.h"
+
+HashPipeline::FileSlot &HashPipeline::getSlot(size_t file_idx)
+{
+    // mtx must be held
+    return slots[file_idx - emit_file];
+}
+
+void HashPipeline::submitBatch(size_t file_idx, std::shared_ptr<Batch> &batch)
+{
+    if (!batch || batch->blocks.empty()) return;
+    std::unique_lock<std::mutex> lock(mtx);
+    // references to deque elements stay valid while other slots are pushed or popped
+    auto &slot = getSlot(file_idx);
+    reader_cv.wait(lock, [&]() { return slot.batches.size() < max_batches; });
+    slot.batches.push_back(batch);
+    hash_queue.push_back(batch);
+    hasher_cv.notify_one();
+    batch.reset();
+}
+
+bool LookupQueue::needData(uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags)
+{
+    uint64_t hash_value = -1;
+    HashSource hash_source = lookup ? lookup(physical_off, logical_off, data_size, extent_flags, hash_value) : HASH_READ;
+    results.push_back(std::make_pair(hash_source, hash_value));
+    return hash_source == HASH_READ;
+}
+HashSource LookupQueue::take(uint64_t &hash_value)
+{
+    VERIFY(!results.empty());
+    auto r = results.front();
+    results.pop_front();
+    hash_value = r.second;
+    return r.first;
+}
+
+void HashPipeline::readerMain()
+{
+    while (1) {
+        size_t file_idx;
+        {
+            // claim next file, but don't run too far ahead of emitter
+            std::unique_lock<std::mutex> lock(mtx);
+            reader_cv.wait(lock, [&]() { return next_file >= n_files || next_file < emit_file + n_threads; });
+            if (next_file >= n_files) return;
+            file_idx = next_file++;
+            slots.emplace_back();
+        }
+
+        std::shared_ptr<Batch> batch;
+        LookupQueue lookups;
+        bool success = KernelInterface::getFileBlocks(file_name(file_idx), block_size, [&](const FileInfo &info) {
+            if (make_lookup) {
+                lookups = LookupQueue(make_lookup(file_idx, info));
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+            auto &slot = getSlot(file_idx);
+            slot.info_ready = true;
+            slot.info = info;
+            emitter_cv.notify_all();
+        }, [&](uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags, auto read_data) {
+            if (!batch) {
+                batch = std::make_shared<Batch>();
+                batch->blocks.reserve(batch_blocks);
+                batch->data.resize(batch_blocks * block_size);
+            }
+            HashedBlock block;
+            block.physical_off = physical_off;
+            block.logical_off = logical_off;
+            block.data_size = data_size;
+            block.extent_flags = extent_flags;
+            block.hash_source = lookups.take(block.hash_value);
+            if (block.hash_source != HASH_READ) {
+                block.read_success = true;
+            } else {
+                char *buffer = read_data();
+                block.read_success = buffer != nullptr;
+                if (buffer) {
+                    memcpy(batch->data.data() + batch->blocks.size() * block_size, buffer, data_size);
+                }
+            }
+            batch->blocks.push_back(block);
+            if (batch->blocks.size() >= batch_blocks) {
+                submitBatch(file_idx, batch);
+            }
+        }, [&](uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags) {
+            return lookups.needData(physical_off, logical_off, data_size, extent_flags);
+        });
+        submitBatch(file_idx, batch);
+
+        std::lock_guard<std::mutex> lock(mtx);
+        auto &slot = getSlot(file_idx);
+        slot.finished = true;
+        slot.success = success;
+        emitter_cv.notify_all();
+    }
+}
+
+void HashPipeline::hasherMain()
+{
+    while (1) {
+        std::shared_ptr<Batch> batch;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            hasher_cv.wait(lock, [&]() { return stop_hasher || !hash_queue.empty(); });
+            if (hash_queue.empty()) return;
+            batch = hash_queue.front();
+            hash_queue.pop_front();
+        }
+
+        for (size_t i = 0; i < batch->blocks.size(); i++) {
+            auto &block = batch->blocks[i];
+            if (block.read_success && block.hash_source == HASH_READ) {
+                block.hash_value = hash_func(batch->data.data() + i * block_size, block.data_size);
+                if (store_hash) {
+                    store_hash(block);
+                }
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mtx);
+        batch->hashed = true;
+        emitter_cv.notify_all();
+    }
+}
+
+void HashPipeline::run(size_t _n_files, std::function<const std::string &(size_t)> _file_name, std::function<uint64_t(const char *, uint64_t)> _hash_func,
+                       std::function<void(size_t file_idx, const FileInfo &info)> info_callback,
+                       std::function<void(size_t file_idx, const HashedBlock &block)> block_callback,
+                       std::function<void(size_t file_idx, bool success)> finish_callback)
+{
+    VERIFY(n_threads > 0);
+    n_files = _n_files;
+    file_name = _file_name;
+    hash_func = _hash_func;
+    next_file = 0;
+    emit_file = 0;
+    slots.clear();
+    hash_queue.clear();
+    stop_hasher = false;
+
+    std::vector<std::thread> readers, hashers;
+    for (int i = 0; i < n_threads; i++) {
+        readers.emplace_back(&HashPipeline::readerMain, this);
+        hashers.emplace_back(&HashPipeline::hasherMain, this);
+    }
+
+    for (size_t file_idx = 0; file_idx < n_files; file_idx++) {
+        std::unique_lock<std::mutex> lock(mtx);
+        emitter_cv.wait(lock, [&]() { return next_file > file_idx && (getSlot(file_idx).info_ready || getSlot(file_idx).finished); });
+        auto &slot = getSlot(file_idx);
+
+        if (slot.info_ready) {
+            FileInfo info = slot.info;
+            lock.unlock();
+            info_callback(file_idx, info);
+            lock.lock();
+        }
+
+        while (1) {
+            emitter_cv.wait(lock, [&]() { return slot.batches.empty() ? slot.finished : slot.batches.front()->hashed; });
+            if (slot.batches.empty()) break;
+            auto batch = slot.batches.front();
+            slot.batches.pop_front();
+            reader_cv.notify_all();
+            lock.unlock();
+            for (auto &block: batch->blocks) {
+                block_callback(file_idx, block);
+            }
+            lock.lock();
+        }
+
+        bool success = slot.success;
+        slots.pop_front();
+        emit_file++;
+        reader_cv.notify_all();
+        lock.unlock();
+
+        finish_callback(file_idx, success);
+    }
+
+    for (auto &t: readers) {
+        t.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop_hasher = true;
+        hasher_cv.notify_all();
+    }
+    for (auto &t: hashers) {
+        t.join();
+    }
+}
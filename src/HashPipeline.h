@@ -0,0 +1,96 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#include "KernelInterface.h"
+
+enum HashSource {
+    HASH_READ, // data is read and hashed
+    HASH_REFLINK, // hash of a reflinked physical block seen before
+    HASH_INDEX, // hash from persistent index, file unchanged
+    HASH_CSUM, // derived from btrfs checksum, which no other block has
+};
+
+// finds hash of a block without reading it, HASH_READ if not found
+typedef std::function<HashSource(uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags, uint64_t &hash_value)> HashLookup;
+
+// runs lookups ahead of reading, as need_data of KernelInterface::getExtentBlocks
+//   results are taken back in the same block order
+class LookupQueue {
+    HashLookup lookup;
+    std::deque<std::pair<HashSource, uint64_t/*hash_value*/>> results;
+public:
+    LookupQueue(HashLookup _lookup = nullptr) : lookup(_lookup) {}
+
+    bool needData(uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags); // true if block must be read
+    HashSource take(uint64_t &hash_value);
+};
+
+struct HashedBlock {
+    uint64_t physical_off;
+    uint64_t logical_off;
+    uint64_t data_size;
+    uint32_t extent_flags;
+    uint64_t hash_value;
+    bool read_success;
+    HashSource hash_source;
+};
+
+// reader threads -> hasher threads -> ordered emitter (the calling thread)
+//   all callbacks are called on the calling thread, in file order and block order
+class HashPipeline {
+    struct Batch {
+        std::vector<HashedBlock> blocks;
+        std::vector<char> data;
+        bool hashed = false;
+    };
+    struct FileSlot {
+        std::deque<std::shared_ptr<Batch>> batches;
+        bool info_ready = false;
+        bool finished = false;
+        bool success = false;
+        FileInfo info;
+    };
+
+    int n_threads;
+    uint64_t block_size;
+
+    size_t n_files;
+    std::function<const std::string &(size_t)> file_name;
+    std::function<uint64_t(const char *, uint64_t)> hash_func;
+
+    std::mutex mtx;
+    std::condition_variable reader_cv;
+    std::condition_variable hasher_cv;
+    std::condition_variable emitter_cv;
+
+    size_t next_file = 0;
+    size_t emit_file = 0;
+    std::deque<FileSlot> slots; // slots[i] is file (emit_file + i)
+    std::deque<std::shared_ptr<Batch>> hash_queue;
+    bool stop_hasher = false;
+
+    FileSlot &getSlot(size_t file_idx);
+    void submitBatch(size_t file_idx, std::shared_ptr<Batch> &batch);
+
+    void readerMain();
+    void hasherMain();
+
+public:
+    uint64_t batch_blocks = 256; // blocks in a single batch
+    uint64_t max_batches = 4; // max unemitted batches per file
+
+    // optional hooks, called on reader and hasher threads
+    std::function<HashLookup(size_t file_idx, const FileInfo &info)> make_lookup; // per file
+    std::function<void(const HashedBlock &block)> store_hash; // after a block is read and hashed
+
+    HashPipeline(int _n_threads, uint64_t _block_size) : n_threads(_n_threads), block_size(_block_size) {}
+
+    void run(size_t _n_files, std::function<const std::string &(size_t)> _file_name, std::function<uint64_t(const char *, uint64_t)> _hash_func,
+             std::function<void(size_t file_idx, const FileInfo &info)> info_callback,
+             std::function<void(size_t file_idx, const HashedBlock &block)> block_callback,
+             std::function<void(size_t file_idx, bool success)> finish_callback);
+};
@@ -4,13 +4,24 @@
 
 HashStorage::~HashStorage()
 {
+    clear();
+}
+void HashStorage::clear()
+{
+    stor_writer.clear();
+    stor_reader.clear();
     for (int i = 0; i < n_stor; i++) {
         remove(makeFileName(i).c_str());
     }
+    n_stor = 0;
+    in_memory = false;
+    discardBuffer();
+    stor_name.clear();
 }
 void HashStorage::beginEmitRecord()
 {
-    buffer_cap = sort_mem * 1048576 / sizeof(HashRecord);
+    uint64_t mem = sort_mem * 1048576;
+    buffer_cap = std::max<uint64_t>((mem - std::min(mem, reserved_mem)) / sizeof(HashRecord), 1);
     reserveBuffer();
 }
 void HashStorage::emitRecord(const HashRecord &new_record)
@@ -30,11 +41,13 @@ void HashStorage::writeRecord(std::unique_ptr<IntWriter> &writer, const HashReco
 {
     writer->writeInt(record.hash_value);
     writer->writeZippedInt(record.logical_id);
+    writer->writeZippedInt(record.physical_id);
 }
 bool HashStorage::readRecord(std::unique_ptr<IntReader> &reader, HashRecord &record)
 {
     record.hash_value = reader->readInt();
     record.logical_id = reader->readZippedInt();
+    record.physical_id = reader->readZippedInt();
     return !reader->eofOccured();
 }
 void HashStorage::discardBuffer()
@@ -68,44 +81,36 @@ void HashStorage::flushWriteBuffer()
 }
 void HashStorage::finishEmitRecord()
 {
+    if (n_stor == 0 && record_buffer.size() * sizeof(HashRecord) <= keep_mem) {
+        // small job, sort and keep everything in memory
+        in_memory = true;
+        sortBuffer();
+        record_buffer.shrink_to_fit();
+        LOG("  hash storage '%s' kept %zu records in memory.\n", stor_path.c_str(), record_buffer.size());
+        return;
+    }
     flushWriteBuffer();
     discardBuffer();
     uint64_t space_used = 0;
     for (auto &w: stor_writer) {
         w->flush();
-        uint64_t written_bytes = w->tell();
-        stor_used_bytes.push_back(written_bytes);
-        space_used += written_bytes;
+        space_used += w->tell();
     }
     LOG("  hash storage used %s of disk space.\n", HB(space_used));
 }
-void HashStorage::iterateSortedRecordInternal(bool file_sorted, std::function<void()> begin_callback, std::function<void(int, HashRecord &)> record_callback)
+uint64_t HashStorage::memoryUsed()
 {
-    if (!file_sorted) {
-        reserveBuffer();
-        for (int stor_id = 0; stor_id < n_stor; stor_id++) {
-            auto &file_name = stor_name[stor_id];
-            LOG("  sorting records in '%s' ...\n", file_name.c_str());
-            HashRecord record;
-            auto &reader = stor_reader[stor_id];
-            record_buffer.clear();
-            reader->rewind();
-            while (readRecord(reader, record)) {
-                record_buffer.push_back(record);
-            }
-            sortBuffer();
-            auto &writer = stor_writer[stor_id];
-            writer->rewind();
-            for (auto &r: record_buffer) {
-                writeRecord(writer, r);
-            }
-            writer->flush();
+    return in_memory ? record_buffer.capacity() * sizeof(HashRecord) : 0;
+}
+void HashStorage::iterateSortedRecord(std::function<void(const HashRecord &)> iter_callback)
+{
+    if (in_memory) {
+        for (auto &r: record_buffer) {
+            iter_callback(r);
         }
-        discardBuffer();
+        return;
     }
-
     LOG("  performing %d-way merge-sort ...\n", n_stor);
-    begin_callback();
     std::vector<HashRecord> head(n_stor);
     auto pqcomp = [&](int lhs, int rhs) { return !comparator(head[lhs], head[rhs]); };
     std::priority_queue<int, std::vector<int>, decltype(pqcomp)> pq(pqcomp);
@@ -117,45 +122,9 @@ void HashStorage::iterateSortedRecordInternal(bool file_sorted, std::function<vo
     }
     while (!pq.empty()) {
         int stor_id = pq.top(); pq.pop();
-        record_callback(stor_id, head[stor_id]);
+        iter_callback(head[stor_id]);
         if (readRecord(stor_reader[stor_id], head[stor_id])) {
             pq.push(stor_id);
         }
     }
 }
-
-void HashStorage::iterateSortedRecord(bool file_sorted, std::function<void(const HashRecord &)> iter_callback)
-{
-    iterateSortedRecordInternal(file_sorted, [](){}, [&](int stor_id, HashRecord &record) {
-        iter_callback(record);
-    });
-}
-
-void HashStorage::iterateSortedRecordAndModifyHashInplace(bool file_sorted, std::function<void(HashRecord &)> iter_callback, std::function<void()> flush_callback)
-{
-    // only hash_value can be changed, because record size can't change
-    // the write sequence can not be changed
-    std::deque<int> q;
-    writeRecordInplace = [&](const HashRecord &record) {
-        writeRecord(stor_writer[q.front()], record);
-        q.pop_front();
-    };
-    iterateSortedRecordInternal(file_sorted,
-        [&]() {
-            for (auto &w: stor_writer) {
-                w->rewind();
-            }
-        },
-        [&](int stor_id, HashRecord &record) {
-            q.push_back(stor_id);
-            iter_callback(record);
-        }
-    );
-    flush_callback();
-    auto it = stor_used_bytes.begin();
-    for (auto &w: stor_writer) {
-        w->flush();
-        VERIFY(w->tell() == *it++);
-    }
-    writeRecordInplace = nullptr;
-}
\ No newline at end of file
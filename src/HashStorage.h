@@ -9,10 +9,11 @@ struct HashRecord {
         uint64_t group_id;
     };
     uint64_t logical_id;
+    uint64_t physical_id;
 
     void dump() const
     {
-        LOG("%016" PRIX64 " %016" PRIX64 "\n", hash_value, logical_id);
+        LOG("%016" PRIX64 " %016" PRIX64 " %016" PRIX64 "\n", hash_value, logical_id, physical_id);
     }
 };
 
@@ -20,12 +21,12 @@ class HashStorage {
     uint64_t buffer_cap; // max records in a single file
 
     std::vector<HashRecord> record_buffer;
+    bool in_memory = false; // all records fit in record_buffer, no files written
 
     int n_stor = 0;
     std::vector<std::string> stor_name;
     std::vector<std::unique_ptr<IntWriter>> stor_writer;
     std::vector<std::unique_ptr<IntReader>> stor_reader;
-    std::vector<uint64_t> stor_used_bytes;
 
 
     std::string makeFileName(int stor_id);
@@ -39,12 +40,12 @@ class HashStorage {
     void sortBuffer();
     void flushWriteBuffer();
 
-    void iterateSortedRecordInternal(bool file_sorted, std::function<void()> begin_callback, std::function<void(int, HashRecord &)> record_callback);
-
 public:
     ~HashStorage();
     
     uint64_t sort_mem = 600;
+    uint64_t reserved_mem = 0; // bytes of sort_mem held by another storage, buffer gets the rest
+    uint64_t keep_mem = UINT64_MAX; // keep records in memory after finishEmitRecord() only if they fit in this many bytes
     std::string stor_path = "hashstorage";
     
     std::function<bool(const HashRecord &, const HashRecord &)> comparator;
@@ -54,8 +55,8 @@ public:
     void emitRecord(const HashRecord &new_record);
     void finishEmitRecord();
 
-    void iterateSortedRecord(bool file_sorted, std::function<void(const HashRecord &)> iter_callback);
+    void iterateSortedRecord(std::function<void(const HashRecord &)> iter_callback); // records are sorted when emitted
 
-    void iterateSortedRecordAndModifyHashInplace(bool file_sorted, std::function<void(HashRecord &)> iter_callback, std::function<void()> flush_callback);
-    std::function<void(const HashRecord &new_record)> writeRecordInplace;
+    uint64_t memoryUsed(); // bytes of records kept in memory after finishEmitRecord()
+    void clear(); // remove all files and records, records can be emitted again
 };
@@ -25,6 +25,18 @@ uint64_t IntReader::tell()
 {
     return ftell(fp);
 }
+void IntReader::seek(uint64_t offset)
+{
+    VERIFY(fseeko(fp, offset, SEEK_SET) == 0);
+}
+uint64_t IntReader::length()
+{
+    uint64_t offset = ftello(fp);
+    VERIFY(fseeko(fp, 0, SEEK_END) == 0);
+    uint64_t size = ftello(fp);
+    VERIFY(fseeko(fp, offset, SEEK_SET) == 0);
+    return size;
+}
 bool IntReader::eofOccured()
 {
     return feof(fp);
@@ -11,6 +11,8 @@ public:
     void rewind();
     void flush();
     uint64_t tell();
+    void seek(uint64_t offset);
+    uint64_t length();
     bool eofOccured();
     uint8_t readByte();
     uint64_t readInt();
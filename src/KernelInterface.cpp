@@ -4,161 +4,604 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/resource.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <linux/fs.h>
 #include <linux/fiemap.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
 
+#include <mutex>
+
+#include "AsyncIO.h"
 #include "KernelInterface.h"
 
 
+uint64_t KernelInterface::read_window = 4 * 1048576;
+bool KernelInterface::use_io_uring = false;
+unsigned KernelInterface::io_depth = 16;
+bool KernelInterface::fiemap_sync = true;
+unsigned KernelInterface::fiemap_window = 512;
+KernelInterface::CacheMode KernelInterface::cache_mode = KernelInterface::CACHE_NORMAL;
+std::mutex KernelInterface::synced_mtx;
+std::set<dev_t> KernelInterface::synced_fs;
+
+bool KernelInterface::initAsyncIO()
+{
+    if (!use_io_uring) return false;
+    if (!getAsyncIO()) {
+        use_io_uring = false;
+        LOG("warning: io_uring is unavailable, using synchronous I/O.\n");
+        return false;
+    }
+    LOG("using io_uring with queue depth %u.\n", getAsyncIO()->capacity());
+    return true;
+}
+AsyncIO *KernelInterface::getAsyncIO()
+{
+    // each thread has its own ring
+    static thread_local std::unique_ptr<AsyncIO> aio;
+    static thread_local bool tried = false;
+    if (!use_io_uring) return nullptr;
+    if (!tried) {
+        tried = true;
+        aio = AsyncIO::create(io_depth);
+    }
+    return aio.get();
+}
+
 const char *KernelInterface::getError(int e)
 {
     return strerror(e); // not thread-safe
 }
 
-bool KernelInterface::getFileBlocks(const std::string &file_name, int block_size, std::function<void(uint64_t file_size)> info_callback, std::function<void(uint64_t physical_off, uint64_t logical_off, uint64_t data_size, std::function<char *()> read_data)> iter_callback)
+int KernelInterface::openRead(const char *file_str)
+{
+    if (cache_mode == CACHE_DIRECT) {
+        int fd = open(file_str, O_RDONLY | O_DIRECT);
+        if (fd != -1 || errno != EINVAL) return fd;
+        // O_DIRECT not supported by file system, fall back to buffered read
+    }
+    return open(file_str, O_RDONLY);
+}
+int KernelInterface::openReadFD(const std::string &file_name)
+{
+    auto file_str = file_name.c_str();
+    int fd = openRead(file_str);
+    if (fd == -1) {
+        LOG("error: can't open '%s'. (%s)\n", file_str, getError(errno));
+    }
+    return fd;
+}
+void KernelInterface::resetSyncedFileSystems()
+{
+    std::lock_guard<std::mutex> lock(synced_mtx);
+    synced_fs.clear();
+}
+void KernelInterface::syncFileSystem(int fd, dev_t dev)
+{
+    // sync each file system once per run, instead of FIEMAP_FLAG_SYNC on every file
+    std::lock_guard<std::mutex> lock(synced_mtx);
+    if (synced_fs.insert(dev).second) {
+        LOG("syncing file system %u:%u ...\n", major(dev), minor(dev));
+        if (syncfs(fd) == -1) {
+            LOG("warning: syncfs failed. (%s)\n", getError(errno));
+        }
+    }
+}
+bool KernelInterface::hasPhysicalAddress(uint32_t extent_flags)
+{
+    return !(extent_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC));
+}
+int KernelInterface::openFileForMap(const std::string &file_name, FileInfo &info)
 {
     auto file_str = file_name.c_str();
     struct stat sb;
-    struct fiemap mapprobe;
-    struct fiemap *mapdata = NULL;
-    char *buffer = (char *) malloc(block_size);
-    int fd = -1;
-    int r;
-    bool success = false;
-    size_t array_bytes;
+    int fd;
 
     if (lstat(file_str, &sb) == -1) {
         printf("error: can't lstat '%s', file ignored. (%s)\n", file_str, getError(errno));
-        goto fail;
+        return -1;
     }
 
     if ((sb.st_mode & S_IFMT) != S_IFREG) {
         printf("error: '%s' is not a regular file, file ignored.\n", file_str);
-        goto fail;
+        return -1;
     }
 
-    fd = open(file_str, O_RDONLY); // ignore race cond between lstat() and open()
+    fd = openRead(file_str); // ignore race cond between lstat() and open()
     if (fd == -1) {
         printf("error: can't open '%s', file ignored. (%s)\n", file_str, getError(errno));
-        goto fail;
+        return -1;
     }
 
     if (sb.st_size == 0) {
         // ignore empty files
-        goto fail;
-    }
-
-    memset(&mapprobe, 0, sizeof(mapprobe));
-    mapprobe.fm_start = 0;
-    mapprobe.fm_length = sb.st_size;
-    mapprobe.fm_flags = FIEMAP_FLAG_SYNC;
-    mapprobe.fm_extent_count = 0;
-
-    r = ioctl(fd, FS_IOC_FIEMAP, &mapprobe);
-    if (r < 0) {
-        printf("error: '%s' fiemap failed, file ignored. (%s)\n", file_str, getError(errno));
-        goto fail;
-    }
-
-    array_bytes = sizeof(struct fiemap_extent) * mapprobe.fm_mapped_extents; // ignore integer overflow
-    mapdata = (struct fiemap *) malloc(sizeof(struct fiemap) + array_bytes);
-    if (!mapdata) {
-        printf("error: can't alloc memory for fiemap '%s', file ignored. (%s)\n", file_str, getError(errno));
-        goto fail;
-    }
-    memset(mapdata, 0, sizeof(struct fiemap) + array_bytes);
-    mapdata->fm_start = 0;
-    mapdata->fm_length = sb.st_size;
-    mapdata->fm_flags = FIEMAP_FLAG_SYNC;
-    mapdata->fm_extent_count = mapprobe.fm_mapped_extents;
-
-    r = ioctl(fd, FS_IOC_FIEMAP, mapdata);
-    if (r < 0) {
-        printf("error: '%s' fiemap failed, file ignored. (%s)\n", file_str, getError(errno));
-        goto fail;
-    }
-
-    info_callback(sb.st_size);
-
-    for (uint64_t i = 0; i < mapdata->fm_mapped_extents; i++) {
-        auto e = &mapdata->fm_extents[i];
-        //printf("%x %llx %llx %llx\n", e->fe_flags, e->fe_logical, e->fe_physical, e->fe_length);
-        if (e->fe_flags & FIEMAP_EXTENT_NOT_ALIGNED) continue;
-        if (e->fe_logical % block_size != 0 || e->fe_physical % block_size != 0 || e->fe_length % block_size != 0) {
-            printf("warning: '%s' extents not aligned, extents ignored.\n", file_str);
-            continue;
-        }
-        for (uint64_t off = 0; off < e->fe_length; off += block_size) {
-            uint64_t data_size = std::min((uint64_t)(sb.st_size - (e->fe_logical + off)), (uint64_t) block_size);
-            
-            iter_callback(e->fe_physical + off, e->fe_logical + off, data_size, [&]()-> char *{
-                if (lseek(fd, e->fe_logical + off, SEEK_SET) == -1) {
-                    printf("warning: '%s' lseek failed, block ignored. (%s)\n", file_str, getError(errno));
-                    return nullptr;
+        close(fd);
+        return -1;
+    }
+
+    if (!fiemap_sync) {
+        syncFileSystem(fd, sb.st_dev);
+    }
+
+    info.size = sb.st_size;
+    info.dev = sb.st_dev;
+    info.ino = sb.st_ino;
+    info.mtime_ns = sb.st_mtim.tv_sec * 1000000000ULL + sb.st_mtim.tv_nsec;
+    info.ctime_ns = sb.st_ctim.tv_sec * 1000000000ULL + sb.st_ctim.tv_nsec;
+    return fd;
+}
+
+bool KernelInterface::mapFileExtents(int fd, const std::string &file_name, int block_size, const FileInfo &info, std::function<void(const FileInfo &info)> info_callback, std::function<void(const std::vector<FileExtent> &extents)> window_callback)
+{
+    // extents are fetched in windows of fiemap_window extents into a reused buffer
+    //   info_callback is called once the first window is mapped
+    auto file_str = file_name.c_str();
+    uint64_t file_size = info.size;
+    const size_t map_bytes = sizeof(struct fiemap) + sizeof(struct fiemap_extent) * fiemap_window;
+    static thread_local std::unique_ptr<struct fiemap, decltype(&free)> mapdata_ptr(nullptr, &free);
+    if (!mapdata_ptr) {
+        mapdata_ptr.reset((struct fiemap *) malloc(map_bytes));
+        VERIFY(mapdata_ptr != nullptr);
+    }
+    struct fiemap *mapdata = mapdata_ptr.get();
+    std::vector<FileExtent> extents;
+    uint64_t start = 0;
+    bool first = true;
+
+    while (start < file_size) {
+        memset(mapdata, 0, map_bytes);
+        mapdata->fm_start = start;
+        mapdata->fm_length = file_size - start;
+        mapdata->fm_flags = fiemap_sync && first ? FIEMAP_FLAG_SYNC : 0; // the first sync flushes the whole file
+        mapdata->fm_extent_count = fiemap_window;
+
+        int r = ioctl(fd, FS_IOC_FIEMAP, mapdata);
+        if (r < 0) {
+            if (first) {
+                printf("error: '%s' fiemap failed, file ignored. (%s)\n", file_str, getError(errno));
+                return false;
+            }
+            printf("error: '%s' fiemap failed, rest of file ignored. (%s)\n", file_str, getError(errno));
+            return true;
+        }
+        if (first) {
+            info_callback(info);
+            first = false;
+        }
+
+        bool last = mapdata->fm_mapped_extents == 0;
+        uint64_t next = start;
+        extents.clear();
+        for (uint64_t i = 0; i < mapdata->fm_mapped_extents; i++) {
+            auto e = &mapdata->fm_extents[i];
+            //printf("%x %llx %llx %llx\n", e->fe_flags, e->fe_logical, e->fe_physical, e->fe_length);
+            if (e->fe_flags & FIEMAP_EXTENT_LAST) last = true;
+            next = std::max(next, (uint64_t) (e->fe_logical + e->fe_length));
+            if (e->fe_flags & FIEMAP_EXTENT_NOT_ALIGNED) continue;
+            if (e->fe_logical % block_size != 0 || e->fe_physical % block_size != 0 || e->fe_length % block_size != 0) {
+                printf("warning: '%s' extents not aligned, extents ignored.\n", file_str);
+                continue;
+            }
+            extents.push_back(FileExtent { e->fe_physical, e->fe_logical, e->fe_length, e->fe_flags });
+        }
+        if (!extents.empty()) {
+            window_callback(extents);
+        }
+        if (last || next <= start) break;
+        start = next;
+    }
+
+    if (first) {
+        // nothing to map
+        info_callback(info);
+    }
+    return true;
+}
+
+void KernelInterface::getExtentBlocks(int fd, const std::string &file_name, int block_size, uint64_t file_size, const std::vector<FileExtent> &extents, std::function<void(uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags, std::function<char *()> read_data)> iter_callback, std::function<bool(uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags)> need_data)
+{
+    // data is read in windows of up to read_window bytes
+    //   synchronous: a window is read on first request of a block in it
+    //   io_uring: up to io_depth windows are read ahead, unless need_data says no block in it is needed
+    struct Window {
+        const FileExtent *extent;
+        uint64_t off;
+        uint64_t length;
+        bool queued; // read ahead by io_uring
+        bool done; // valid range loaded
+        uint64_t valid_begin;
+        uint64_t valid_end;
+    };
+    auto file_str = file_name.c_str();
+    uint64_t window_size = std::max(read_window / block_size, (uint64_t) 1) * block_size;
+    AsyncIO *aio = getAsyncIO();
+    unsigned depth = aio ? aio->capacity() : 1;
+
+    // buffer is aligned for O_DIRECT
+    static thread_local std::unique_ptr<char, decltype(&free)> buffer_ptr(nullptr, &free);
+    static thread_local uint64_t buffer_size = 0;
+    if (buffer_size < window_size * depth) {
+        void *p;
+        VERIFY(posix_memalign(&p, 4096, window_size * depth) == 0);
+        buffer_ptr.reset((char *) p);
+        buffer_size = window_size * depth;
+    }
+    char *buffer = buffer_ptr.get();
+
+    bool direct = fd >= 0 && (fcntl(fd, F_GETFL) & O_DIRECT);
+    bool drop_cache = cache_mode != CACHE_NORMAL && !direct;
+
+    std::vector<Window> windows;
+    for (auto &extent: extents) {
+        for (uint64_t off = 0; off < extent.length; off += window_size) {
+            windows.push_back(Window { &extent, off, std::min(extent.length - off, window_size), false, false, 0, 0 });
+        }
+    }
+
+    // calls need_data for all blocks of window
+    auto window_needed = [&](const Window &w) {
+        bool needed = !need_data;
+        for (uint64_t off = w.off; need_data && off < w.off + w.length; off += block_size) {
+            uint64_t pos = w.extent->logical_off + off;
+            needed = need_data(w.extent->physical_off + off, pos, std::min((uint64_t)(file_size - pos), (uint64_t) block_size), w.extent->flags) || needed;
+        }
+        return needed;
+    };
+
+    size_t next_queue = 0;
+    for (size_t window_id = 0; window_id < windows.size(); window_id++) {
+        auto &w = windows[window_id];
+        char *window_buffer = buffer + (window_id % depth) * window_size;
+
+        if (!aio) {
+            window_needed(w);
+        } else {
+            // windows [window_id, window_id + depth) may be in flight, buffers are reused round-robin
+            while (next_queue < windows.size() && next_queue < window_id + depth) {
+                auto &q = windows[next_queue];
+                if (window_needed(q)) {
+                    VERIFY(aio->queueRead(fd, buffer + (next_queue % depth) * window_size, q.length, q.extent->logical_off + q.off, next_queue));
+                    q.queued = true;
+                }
+                next_queue++;
+            }
+            while (w.queued && !w.done) {
+                uint64_t user_data;
+                int64_t result;
+                aio->waitCompletion(user_data, result);
+                windows[user_data].done = true;
+                windows[user_data].valid_end = std::max(result, (int64_t) 0);
+            }
+        }
+
+        for (uint64_t off = w.off; off < w.off + w.length; off += block_size) {
+            uint64_t pos = w.extent->logical_off + off;
+            uint64_t rel = off - w.off;
+            uint64_t data_size = std::min((uint64_t)(file_size - pos), (uint64_t) block_size);
+
+            iter_callback(w.extent->physical_off + off, pos, data_size, w.extent->flags, [&]()-> char *{
+                if (!w.done) {
+                    ssize_t r = pread(fd, window_buffer + rel, w.length - rel, pos);
+                    w.done = true;
+                    w.valid_begin = rel;
+                    w.valid_end = rel + std::max(r, (ssize_t) 0);
                 }
-                if (read(fd, buffer, data_size) != data_size) {
-                    printf("warning: '%s' read failed, block ignored. (%s)\n", file_str, getError(errno));
-                    return nullptr;
+                if (rel < w.valid_begin || rel + data_size > w.valid_end) {
+                    // window read failed or was short, retry this block alone to isolate the error
+                    //   O_DIRECT needs aligned length, tail block is read as a whole block
+                    if (pread(fd, window_buffer + rel, direct ? block_size : data_size, pos) < (ssize_t) data_size) {
+                        printf("warning: '%s' read failed, block ignored. (%s)\n", file_str, getError(errno));
+                        return nullptr;
+                    }
                 }
-                return buffer;
+                return window_buffer + rel;
             });
         }
+
+        if (drop_cache) {
+            posix_fadvise(fd, w.extent->logical_off + w.off, w.length, POSIX_FADV_DONTNEED);
+        }
     }
+}
+
+bool KernelInterface::getFileExtents(const std::string &file_name, int block_size, std::function<void(const FileInfo &info)> info_callback, std::function<void(const FileExtent &extent)> extent_callback)
+{
+    FileInfo info;
+
+    int fd = openFileForMap(file_name, info);
+    if (fd == -1) return false;
+    bool success = mapFileExtents(fd, file_name, block_size, info, info_callback, [&](const std::vector<FileExtent> &extents) {
+        for (auto &extent: extents) {
+            extent_callback(extent);
+        }
+    });
+    close(fd);
+    return success;
+}
 
-    success = true;
-fail:
-    if (fd != -1) close(fd);
-    if (mapdata) free(mapdata);
-    if (buffer) free(buffer);
+bool KernelInterface::getFileBlocks(const std::string &file_name, int block_size, std::function<void(const FileInfo &info)> info_callback, std::function<void(uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags, std::function<char *()> read_data)> iter_callback, std::function<bool(uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags)> need_data)
+{
+    FileInfo info;
+
+    int fd = openFileForMap(file_name, info);
+    if (fd == -1) return false;
+    bool success = mapFileExtents(fd, file_name, block_size, info, info_callback, [&](const std::vector<FileExtent> &extents) {
+        getExtentBlocks(fd, file_name, block_size, info.size, extents, iter_callback, need_data);
+    });
+    close(fd);
     return success;
 }
 
-bool KernelInterface::copyRange(int dst_fd, uint64_t dst_off, int src_fd, uint64_t src_off, uint64_t length)
+bool KernelInterface::getBtrfsCsumInfo(int fd, BtrfsCsumInfo &csum_info)
+{
+    struct btrfs_ioctl_fs_info_args args;
+    memset(&args, 0, sizeof(args));
+    args.flags = BTRFS_FS_INFO_FLAG_CSUM_INFO;
+    if (ioctl(fd, BTRFS_IOC_FS_INFO, &args) < 0) {
+        return false;
+    }
+    // kernels before 5.5 only have crc32c
+    csum_info.csum_size = (args.flags & BTRFS_FS_INFO_FLAG_CSUM_INFO) ? args.csum_size : 4;
+    csum_info.sector_size = args.sectorsize;
+    csum_info.node_size = args.nodesize;
+    return csum_info.csum_size > 0 && csum_info.sector_size > 0;
+}
+
+bool KernelInterface::getBtrfsCsums(int fd, const BtrfsCsumInfo &csum_info, uint64_t physical_off, uint64_t length, std::function<void(uint64_t bytenr, const uint8_t *csum)> csum_callback)
+{
+    // a checksum item covers at most (node_size / csum_size) sectors, so it starts at most that far before physical_off
+    const uint64_t buf_size = 65536;
+    static thread_local std::unique_ptr<uint64_t[]> search_buf;
+    if (!search_buf) {
+        search_buf.reset(new uint64_t[(sizeof(struct btrfs_ioctl_search_args_v2) + buf_size) / sizeof(uint64_t) + 1]);
+    }
+    auto args = (struct btrfs_ioctl_search_args_v2 *) search_buf.get();
+
+    uint64_t item_span = (uint64_t) csum_info.node_size / csum_info.csum_size * csum_info.sector_size;
+    uint64_t end = physical_off + length;
+    uint64_t next_bytenr = physical_off;
+
+    memset(&args->key, 0, sizeof(args->key));
+    args->key.tree_id = BTRFS_CSUM_TREE_OBJECTID;
+    args->key.min_objectid = args->key.max_objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+    args->key.min_type = args->key.max_type = BTRFS_EXTENT_CSUM_KEY;
+    args->key.min_offset = physical_off > item_span ? physical_off - item_span : 0;
+    args->key.max_offset = end - 1;
+    args->key.min_transid = 0;
+    args->key.max_transid = -1;
+
+    while (1) {
+        args->key.nr_items = -1;
+        args->buf_size = buf_size;
+        if (ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, args) < 0) {
+            return false;
+        }
+        if (args->key.nr_items == 0) break;
+
+        char *p = (char *) args->buf;
+        uint64_t last_offset = 0;
+        for (unsigned i = 0; i < args->key.nr_items; i++) {
+            auto sh = (struct btrfs_ioctl_search_header *) p;
+            auto csum = (const uint8_t *) (p + sizeof(*sh));
+            p += sizeof(*sh) + sh->len;
+            last_offset = sh->offset;
+            if (sh->objectid != BTRFS_EXTENT_CSUM_OBJECTID || sh->type != BTRFS_EXTENT_CSUM_KEY) continue;
+
+            uint64_t n = sh->len / csum_info.csum_size;
+            for (uint64_t j = 0; j < n; j++) {
+                uint64_t bytenr = sh->offset + j * csum_info.sector_size;
+                if (bytenr >= end) break;
+                if (bytenr >= next_bytenr) {
+                    csum_callback(bytenr, csum + j * csum_info.csum_size);
+                    next_bytenr = bytenr + csum_info.sector_size;
+                }
+            }
+        }
+        if (last_offset >= end - 1) break;
+        args->key.min_offset = last_offset + 1;
+    }
+    return true;
+}
+
+bool KernelInterface::copyRange(int dst_fd, uint64_t dst_off, int src_fd, uint64_t src_off, uint64_t length, bool keep_cache)
 {
-    void *buffer = alloca(length);
-    bool success = pread(src_fd, buffer, length, src_off) == length && pwrite(dst_fd, buffer, length, dst_off) == length;
+    // ranges may be large, copy through a buffer of at most read_window bytes
+    static thread_local std::vector<char> buffer;
+    buffer.resize(std::min<uint64_t>(length, read_window));
+    bool success = true;
+    for (uint64_t off = 0; success && off < length; off += buffer.size()) {
+        uint64_t n = std::min<uint64_t>(length - off, buffer.size());
+        success = pread(src_fd, buffer.data(), n, src_off + off) == (ssize_t) n && pwrite(dst_fd, buffer.data(), n, dst_off + off) == (ssize_t) n;
+    }
     if (!success) {
         LOG("error: copy range failed. (%s)\n", getError(errno));
     }
+    if (!keep_cache) {
+        dropCache(src_fd, src_off, length);
+    }
     return success;
 }
+
+void KernelInterface::prefetchRanges(std::vector<std::tuple<int/*fd*/, uint64_t/*offset*/, uint64_t/*length*/>> &ranges)
+{
+    std::sort(ranges.begin(), ranges.end());
+    for (size_t i = 0; i < ranges.size(); ) {
+        auto [fd, offset, length] = ranges[i++];
+        while (i < ranges.size() && std::get<0>(ranges[i]) == fd && std::get<1>(ranges[i]) <= offset + length) {
+            length = std::max(length, std::get<1>(ranges[i]) + std::get<2>(ranges[i]) - offset);
+            i++;
+        }
+        posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+    }
+}
+
+void KernelInterface::dropCache(int fd, uint64_t offset, uint64_t length)
+{
+    if (cache_mode != CACHE_NORMAL) {
+        // files shared with FIDEDUPERANGE can't be opened with O_DIRECT, drop pages instead
+        posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+    }
+}
+
+void KernelInterface::preallocate(int fd, uint64_t length)
+{
+    // not supported by every file system, writes just allocate space as usual then
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, length);
+}
+
+bool KernelInterface::setFileSize(int fd, uint64_t size)
+{
+    if (ftruncate(fd, size) < 0) {
+        LOG("error: ftruncate failed. (%s)\n", getError(errno));
+        return false;
+    }
+    return true;
+}
+
+bool KernelInterface::isZero(const char *data, uint64_t length)
+{
+    // OR words together a cache line at a time, the inner loop is vectorized by compiler
+    uint64_t n = length / 64 * 64;
+    for (uint64_t off = 0; off < n; off += 64) {
+        uint64_t words[8];
+        memcpy(words, data + off, 64);
+        uint64_t acc = 0;
+        for (int i = 0; i < 8; i++) {
+            acc |= words[i];
+        }
+        if (acc) return false;
+    }
+    for (uint64_t off = n; off < length; off++) {
+        if (data[off]) return false;
+    }
+    return true;
+}
+
+uint64_t KernelInterface::dedupToHole(int hole_fd, uint64_t hole_length, int fd, uint64_t offset, uint64_t length)
+{
+    // kernel compares data with the hole under its locks, so data written meanwhile is never lost
+    uint64_t deduped = 0;
+    for (uint64_t off = 0; off < length; off += hole_length) {
+        uint64_t n = std::min(length - off, hole_length);
+        std::vector<std::tuple<int, uint64_t, uint64_t>> targets;
+        targets.push_back(std::make_tuple(fd, offset + off, 0));
+        dedupRange(hole_fd, 0, n, targets, false);
+        if (std::get<2>(targets[0]) == n) {
+            deduped += n;
+        }
+    }
+    dropCache(fd, offset, length);
+    return deduped;
+}
+
 void KernelInterface::dummyRead(int fd, uint64_t offset, uint64_t length)
 {
     void *dummy = malloc(length);
     pread(fd, dummy, length, offset);
     free(dummy);
 }
-void KernelInterface::dedupRange(int src_fd, uint64_t src_offset, uint64_t range_length, std::vector<std::tuple<int/*dest_fd*/, uint64_t/*dest_offset*/, uint64_t/*out_result*/>> &targets)
+void KernelInterface::dummyReadAsync(AsyncIO *aio, const std::vector<std::pair<int/*fd*/, uint64_t/*offset*/>> &ranges, uint64_t length)
 {
-    const size_t dedup_info_size = sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info);
-    char dedup_info_buffer[dedup_info_size];
-    struct file_dedupe_range *dedup_info = (struct file_dedupe_range *) dedup_info_buffer;
+    // data is discarded, so all requests share one buffer
+    void *dummy = malloc(length);
+    for (auto &[fd, offset]: ranges) {
+        while (!aio->queueRead(fd, dummy, length, offset, 0)) {
+            uint64_t user_data;
+            int64_t result;
+            aio->waitCompletion(user_data, result);
+        }
+    }
+    while (aio->pending() > 0) {
+        uint64_t user_data;
+        int64_t result;
+        aio->waitCompletion(user_data, result);
+    }
+    free(dummy);
+}
+bool KernelInterface::dedupRangeOnce(int src_fd, uint64_t src_offset, uint64_t range_length, std::tuple<int, uint64_t, uint64_t> *targets, int *status, size_t n)
+{
+    std::vector<char> dedup_info_buffer(sizeof(struct file_dedupe_range) + n * sizeof(struct file_dedupe_range_info));
+    struct file_dedupe_range *dedup_info = (struct file_dedupe_range *) dedup_info_buffer.data();
 
-    for (auto &dedup_item: targets) {
-        auto &[dest_fd, dest_offset, out_result] = dedup_item;
-        out_result = -1;
-        
-        memset(dedup_info, 0, dedup_info_size);
-        dedup_info->src_offset = src_offset;
-        dedup_info->src_length = range_length;
-        dedup_info->dest_count = 1;
-        dedup_info->info[0].dest_fd = dest_fd;
-        dedup_info->info[0].dest_offset = dest_offset;
-
-        // XXX: workaround strange thrashing in btrfs by preloading file contents
-        dummyRead(src_fd, src_offset, range_length);
-        dummyRead(dest_fd, dest_offset, range_length);
-
-        int r = ioctl(src_fd, FIDEDUPERANGE, dedup_info);
-        if (r == -1) {
-            LOG("error: ioctl FIDEDUPERANGE failed. (%s)\n", getError(errno));
-        } else {
-            if (dedup_info->info[0].status == FILE_DEDUPE_RANGE_SAME) {
-                out_result = dedup_info->info[0].bytes_deduped;
+    dedup_info->src_offset = src_offset;
+    dedup_info->src_length = range_length;
+    dedup_info->dest_count = n;
+    for (size_t i = 0; i < n; i++) {
+        auto &[dest_fd, dest_offset, out_result] = targets[i];
+        dedup_info->info[i].dest_fd = dest_fd;
+        dedup_info->info[i].dest_offset = dest_offset;
+    }
+
+    int r = ioctl(src_fd, FIDEDUPERANGE, dedup_info);
+    if (r == -1) {
+        for (size_t i = 0; i < n; i++) {
+            status[i] = -errno;
+        }
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        auto &[dest_fd, dest_offset, out_result] = targets[i];
+        status[i] = dedup_info->info[i].status;
+        if (status[i] == FILE_DEDUPE_RANGE_SAME) {
+            out_result = dedup_info->info[i].bytes_deduped;
+        }
+    }
+    return true;
+}
+
+void KernelInterface::dedupRange(int src_fd, uint64_t src_offset, uint64_t range_length, std::vector<std::tuple<int/*dest_fd*/, uint64_t/*dest_offset*/, uint64_t/*out_result*/>> &targets, bool preload)
+{
+    // kernel refuses a file_dedupe_range larger than a page
+    static const size_t max_dest = (sysconf(_SC_PAGESIZE) - sizeof(struct file_dedupe_range)) / sizeof(struct file_dedupe_range_info);
+
+    // preload isn't needed if caller has already prefetched the data
+    AsyncIO *aio = preload ? getAsyncIO() : nullptr;
+    if (aio) {
+        // XXX: workaround strange thrashing in btrfs by preloading file contents (all targets at once)
+        std::vector<std::pair<int, uint64_t>> ranges;
+        ranges.push_back(std::make_pair(src_fd, src_offset));
+        for (auto &[dest_fd, dest_offset, out_result]: targets) {
+            ranges.push_back(std::make_pair(dest_fd, dest_offset));
+        }
+        dummyReadAsync(aio, ranges, range_length);
+    }
+
+    // many destinations in a single ioctl
+    std::vector<int> status(targets.size());
+    for (size_t i = 0; i < targets.size(); i += max_dest) {
+        size_t n = std::min(max_dest, targets.size() - i);
+        if (preload && !aio) {
+            // XXX: workaround strange thrashing in btrfs by preloading file contents
+            dummyRead(src_fd, src_offset, range_length);
+            for (size_t j = i; j < i + n; j++) {
+                dummyRead(std::get<0>(targets[j]), std::get<1>(targets[j]), range_length);
             }
         }
+        for (size_t j = i; j < i + n; j++) {
+            std::get<2>(targets[j]) = -1;
+        }
+        dedupRangeOnce(src_fd, src_offset, range_length, &targets[i], &status[i], n);
+    }
+
+    // retry failed destinations one by one (one bad destination may fail the whole call, or stop the kernel early)
+    for (size_t i = 0; i < targets.size(); i++) {
+        auto &out_result = std::get<2>(targets[i]);
+        if (status[i] == FILE_DEDUPE_RANGE_DIFFERS || (status[i] == FILE_DEDUPE_RANGE_SAME && out_result == range_length)) continue;
+        out_result = -1;
+        if (!dedupRangeOnce(src_fd, src_offset, range_length, &targets[i], &status[i], 1)) {
+            LOG("error: ioctl FIDEDUPERANGE failed. (%s)\n", getError(-status[i]));
+        }
+    }
+
+    if (preload) {
+        // preloaded pages would stay in page cache, unless cache_mode is CACHE_NORMAL
+        dropCache(src_fd, src_offset, range_length);
+        for (auto &[dest_fd, dest_offset, out_result]: targets) {
+            dropCache(dest_fd, dest_offset, range_length);
+        }
     }
 }
 
@@ -1,20 +1,89 @@
 #pragma once
 
 #include <fcntl.h>
+#include <mutex>
+
+class AsyncIO;
+
+struct FileExtent {
+    uint64_t physical_off;
+    uint64_t logical_off;
+    uint64_t length;
+    uint32_t flags;
+};
+
+struct FileInfo {
+    uint64_t size;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t mtime_ns;
+    uint64_t ctime_ns;
+};
+
+struct BtrfsCsumInfo {
+    uint32_t csum_size; // bytes per checksum
+    uint32_t sector_size; // bytes covered by a single checksum
+    uint32_t node_size; // tree node size, limits the range of a checksum item
+};
 
 class KernelInterface {
+    static std::mutex synced_mtx;
+    static std::set<dev_t> synced_fs; // file systems synced by syncFileSystem() in this run
+
+    static int openRead(const char *file_str);
+    static int openFileForMap(const std::string &file_name, FileInfo &info);
+    static void syncFileSystem(int fd, dev_t dev);
+    static bool mapFileExtents(int fd, const std::string &file_name, int block_size, const FileInfo &info, std::function<void(const FileInfo &info)> info_callback, std::function<void(const std::vector<FileExtent> &extents)> window_callback);
+    static AsyncIO *getAsyncIO();
+    static bool dedupRangeOnce(int src_fd, uint64_t src_offset, uint64_t range_length, std::tuple<int, uint64_t, uint64_t> *targets, int *status, size_t n);
+    static void dummyReadAsync(AsyncIO *aio, const std::vector<std::pair<int/*fd*/, uint64_t/*offset*/>> &ranges, uint64_t length);
+
 public:
+    static uint64_t read_window; // max bytes read by a single read syscall
+    static bool use_io_uring; // use io_uring if available
+    static unsigned io_depth; // io_uring queue depth (each request uses a read_window sized buffer)
+    static bool fiemap_sync; // use FIEMAP_FLAG_SYNC, or syncfs() once per file system if false
+    static unsigned fiemap_window; // max extents fetched by a single FIEMAP call
+    static void resetSyncedFileSystems(); // without FIEMAP_FLAG_SYNC, sync file systems again in next run
+
+    enum CacheMode {
+        CACHE_NORMAL, // read through page cache
+        CACHE_DROP, // drop pages after reading (also drops pages cached by others)
+        CACHE_DIRECT, // read with O_DIRECT, drop pages if O_DIRECT is unsupported
+    };
+    static CacheMode cache_mode;
+
+    static bool initAsyncIO();
 
     static const char *getError(int e);
     
-    static bool getFileBlocks(const std::string &file_name, int block_size, std::function<void(uint64_t file_size)> info_callback, std::function<void(uint64_t physical_off, uint64_t logical_off, uint64_t data_size, std::function<char *()> read_data)> iter_callback);
+    static bool hasPhysicalAddress(uint32_t extent_flags); // false for delalloc or unknown extents, which report physical 0
+    static bool getFileExtents(const std::string &file_name, int block_size, std::function<void(const FileInfo &info)> info_callback, std::function<void(const FileExtent &extent)> extent_callback);
+    // need_data (optional) is called once for each block in order, before iter_callback of the block
+    //   with io_uring, windows are read ahead only if need_data is true for some block in them
+    static void getExtentBlocks(int fd, const std::string &file_name, int block_size, uint64_t file_size, const std::vector<FileExtent> &extents, std::function<void(uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags, std::function<char *()> read_data)> iter_callback, std::function<bool(uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags)> need_data = nullptr);
+    static bool getFileBlocks(const std::string &file_name, int block_size, std::function<void(const FileInfo &info)> info_callback, std::function<void(uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags, std::function<char *()> read_data)> iter_callback, std::function<bool(uint64_t physical_off, uint64_t logical_off, uint64_t data_size, uint32_t extent_flags)> need_data = nullptr);
+
+    // btrfs data checksums, needs CAP_SYS_ADMIN
+    //   csum_callback is called in bytenr order, for checksums of sectors within [physical_off, physical_off + length)
+    static bool getBtrfsCsumInfo(int fd, BtrfsCsumInfo &csum_info);
+    static bool getBtrfsCsums(int fd, const BtrfsCsumInfo &csum_info, uint64_t physical_off, uint64_t length, std::function<void(uint64_t bytenr, const uint8_t *csum)> csum_callback);
+
+    static bool copyRange(int dst_fd, uint64_t dst_off, int src_fd, uint64_t src_off, uint64_t length, bool keep_cache = false);
+    static void prefetchRanges(std::vector<std::tuple<int/*fd*/, uint64_t/*offset*/, uint64_t/*length*/>> &ranges); // readahead hints, adjacent ranges merged
+    static void dropCache(int fd, uint64_t offset, uint64_t length); // if cache_mode isn't CACHE_NORMAL
+
+    static void preallocate(int fd, uint64_t length); // best effort, file size unchanged
+    static bool setFileSize(int fd, uint64_t size);
 
-    static bool copyRange(int dst_fd, uint64_t dst_off, int src_fd, uint64_t src_off, uint64_t length);
+    static bool isZero(const char *data, uint64_t length);
+    static uint64_t dedupToHole(int hole_fd, uint64_t hole_length, int fd, uint64_t offset, uint64_t length); // hole_fd is a sparse file, returns bytes turned into holes
 
     static void dummyRead(int fd, uint64_t offset, uint64_t length);
-    static void dedupRange(int src_fd, uint64_t src_offset, uint64_t range_length, std::vector<std::tuple<int/*dest_fd*/, uint64_t/*dest_offset*/, uint64_t/*out_result*/>> &targets);
+    static void dedupRange(int src_fd, uint64_t src_offset, uint64_t range_length, std::vector<std::tuple<int/*dest_fd*/, uint64_t/*dest_offset*/, uint64_t/*out_result*/>> &targets, bool preload = true);
 
     static void setMaxFD(int n);
+    static int openReadFD(const std::string &file_name); // respects cache_mode
     static int openFD(const std::string &file_name, int flags = O_RDWR);
     static void closeFD(int fd);
 
@@ -4,6 +4,7 @@
 #include <getopt.h>
 
 #include "DedupInstance.h"
+#include "DedupDaemon.h"
 
 void _verify(bool cond, const char *file, int line, const char *func, const char *expr)
 {
@@ -23,7 +24,8 @@ void _verify(bool cond, const char *file, int line, const char *func, const char
 std::string _logtime()
 {
     time_t result = time(nullptr);
-    std::string t(ctime(&result)); // not thread-safe
+    char buf[64]; // ctime_r needs at least 26 bytes
+    std::string t(ctime_r(&result, buf)); // also called by workers
     t.pop_back();
     return t;
 }
@@ -55,21 +57,50 @@ static std::string build_help(int argc, char *argv[], DedupInstance &d)
     hlp += buf; sprintf(buf, "Usage:\n");
     hlp += buf; sprintf(buf, "\n");
     hlp += buf; sprintf(buf, "  find /path/to/dedup -type f -print0 | %s [OPTIONS]\n", argv[0]);
+    hlp += buf; sprintf(buf, "  printf '/path/to/watch\\0' | %s --daemon SECONDS [OPTIONS]\n", argv[0]);
     hlp += buf; sprintf(buf, "\n");
     hlp += buf; sprintf(buf, "Parameters:\n");
     hlp += buf; sprintf(buf, "  -t, --temp-size          Temporary chunk storage size in bytes\n"
                              "                             [default: %" PRIu64 "]\n", d.chunk_limit);
+    hlp += buf; sprintf(buf, "  -p, --prefetch           Bytes of duplicate data prefetched together by readahead hints, instead of reading each block again\n"
+                             "                             [default: %" PRIu64 "]  (0 to disable, hint: must fit in page cache)\n", d.prefetch_size);
     hlp += buf; sprintf(buf, "  -m, --sort-mem           Sort buffer size in MiB\n"
                              "                             [default: %" PRIu64 "]  (hint: set this to about 1/3 of RAM size)\n", d.hash_storage.sort_mem);
     hlp += buf; sprintf(buf, "  -r, --ref-limit          Max references to a single block\n"
                              "                             [default: %" PRIu64 "]\n", d.ref_limit);
     hlp += buf; sprintf(buf, "  -b, --block-size         File system block size in bytes\n"
                              "                             [default: %" PRIu64 "]\n", d.block_size);
+    hlp += buf; sprintf(buf, "  -u, --unit-size          Dedup granularity in bytes, a multiple of block size (0 for block size)\n"
+                             "                             [default: %" PRIu64 "]  (larger units: less memory, disk and extents, but less dedup)\n", d.unit_size);
+    hlp += buf; sprintf(buf, "  -j, --threads            Threads for reading & hashing files\n"
+                             "                             [default: %d]\n", d.hash_threads);
+    hlp += buf; sprintf(buf, "      --dedup-threads      Threads for submitting ranges to kernel, each with its own chunk file\n"
+                             "                             [default: %d]\n", d.dedup_threads);
+    hlp += buf; sprintf(buf, "  -x, --reflink-cache      Max cached hashes of reflinked blocks (0 to disable)\n"
+                             "                             [default: %" PRIu64 "]\n", d.hash_cache.max_entries);
+    hlp += buf; sprintf(buf, "  -w, --order-window       Max files scheduled together by --physical-order\n"
+                             "                             [default: %" PRIu64 "]\n", d.order_window);
+    hlp += buf; sprintf(buf, "      --submit-window      Max ranges reordered by physical address when submitting to kernel (HDD friendly)\n"
+                             "                             [default: %" PRIu64 " (disabled)]\n", d.submit_window);
+    hlp += buf; sprintf(buf, "  -d, --daemon             Watch piped directories (recursively) and dedup changed files every N seconds\n"
+                             "                             [default: 0]  (0 to disable, hint: use with '--hash-index')\n");
     hlp += buf; sprintf(buf, "\n");
     hlp += buf; sprintf(buf, "Options:\n");
     hlp += buf; sprintf(buf, "  -s, --hash-file <FILE>   Temporary hash storage path  [default: %s.XXXX]\n", d.hash_storage.stor_path.c_str());
     hlp += buf; sprintf(buf, "  -c, --chunk-file <FILE>  Temporary chunk storage path  [default: %s]\n", d.chunk_file.c_str());
+    hlp += buf; sprintf(buf, "  -i, --hash-index <FILE>  Persistent hash index, unchanged files are not read again  [default: none]\n");
+    hlp += buf; sprintf(buf, "      --whole-file         Find identical files first, dedup all but one of each as whole files instead of by blocks\n");
+    hlp += buf; sprintf(buf, "      --punch-zero         Punch holes for all-zero blocks (or units) instead of deduping them\n");
+    hlp += buf; sprintf(buf, "      --in-place           Dedup duplicate groups against one of their members instead of a copy in chunk store\n");
+    hlp += buf; sprintf(buf, "      --btrfs-csum         Find candidates by btrfs data checksums, read only blocks whose checksums collide (needs root)\n"
+                             "                             (blocks in compressed or nodatasum extents never match checksum-unique blocks)\n");
+    hlp += buf; sprintf(buf, "      --physical-order     Read blocks in physical order (HDD friendly, single-threaded)\n");
+    hlp += buf; sprintf(buf, "      --io-uring           Use io_uring for reads if available\n");
+    hlp += buf; sprintf(buf, "      --drop-cache         Drop file data from page cache after reading\n");
+    hlp += buf; sprintf(buf, "      --direct-io          Read file data with O_DIRECT when hashing (bypass page cache)\n");
+    hlp += buf; sprintf(buf, "      --no-fiemap-sync     Sync each file system once instead of syncing every file on FIEMAP\n");
     hlp += buf; sprintf(buf, "      --no-relocate        Don't relocate unique data blocks (significantly less space freed)\n");
+    hlp += buf; sprintf(buf, "      --relocate-all       Relocate all unique data blocks, even those in extents no space is freed from\n");
     hlp += buf; sprintf(buf, "      --no-dedup           Show dedup plan only, don't do real dedup operations\n");
     hlp += buf; sprintf(buf, "\n");
     hlp += buf; /* end */
@@ -86,23 +117,44 @@ int main(int argc, char *argv[])
     DedupInstance d;
 
     std::string hlp = build_help(argc, argv, d);
+    uint64_t daemon_interval = 0;
 
     while (1) {
         static struct option long_options[] = {
             {"hash-file", required_argument, 0, 's'},
             {"chunk-file", required_argument, 0, 'c'},
+            {"hash-index", required_argument, 0, 'i'},
             {"temp-size", required_argument, 0, 't'},
+            {"prefetch", required_argument, 0, 'p'},
             {"sort-mem", required_argument, 0, 'm'},
             {"ref-limit", required_argument, 0, 'r'},
             {"block-size", required_argument, 0, 'b'},
+            {"unit-size", required_argument, 0, 'u'},
+            {"threads", required_argument, 0, 'j'},
+            {"order-window", required_argument, 0, 'w'},
+            {"reflink-cache", required_argument, 0, 'x'},
+            {"daemon", required_argument, 0, 'd'},
+            {"physical-order", no_argument, 0, 10002},
+            {"io-uring", no_argument, 0, 10003},
+            {"drop-cache", no_argument, 0, 10004},
+            {"direct-io", no_argument, 0, 10005},
+            {"no-fiemap-sync", no_argument, 0, 10006},
+            {"btrfs-csum", no_argument, 0, 10007},
+            {"whole-file", no_argument, 0, 10008},
+            {"punch-zero", no_argument, 0, 10009},
+            {"in-place", no_argument, 0, 10010},
+            {"relocate-all", no_argument, 0, 10011},
+            {"submit-window", required_argument, 0, 10012},
+            {"dedup-threads", required_argument, 0, 10013},
             {"no-relocate", no_argument, 0, 10000},
             {"no-dedup", no_argument, 0, 10001},
             {"help", no_argument, 0, 'h'},
             { /* end of options */ }
         };
-        int c = getopt_long(argc, argv, "s:c:t:m:r:b:h", long_options, NULL);
+        int c = getopt_long(argc, argv, "s:c:i:t:p:m:r:b:u:j:w:x:d:h", long_options, NULL);
         if (c == -1) break;
         char *p;
+        uint64_t value;
         switch (c) {
 
         case 's':
@@ -111,9 +163,15 @@ int main(int argc, char *argv[])
         case 'c':
             d.chunk_file = std::string(optarg);
             break;
+        case 'i':
+            d.hash_index_file = std::string(optarg);
+            break;
         case 't':
             if (!str2u64(d.chunk_limit, optarg)) goto bad_number;
             break;
+        case 'p':
+            if (!str2u64(d.prefetch_size, optarg)) goto bad_number;
+            break;
         case 'm':
             if (!str2u64(d.hash_storage.sort_mem, optarg)) goto bad_number;
             break;
@@ -123,6 +181,22 @@ int main(int argc, char *argv[])
         case 'b':
             if (!str2u64(d.block_size, optarg)) goto bad_number;
             break;
+        case 'u':
+            if (!str2u64(d.unit_size, optarg)) goto bad_number;
+            break;
+        case 'j':
+            if (!str2u64(value, optarg) || value < 1 || value > 1024) goto bad_number;
+            d.hash_threads = value;
+            break;
+        case 'x':
+            if (!str2u64(d.hash_cache.max_entries, optarg)) goto bad_number;
+            break;
+        case 'w':
+            if (!str2u64(d.order_window, optarg) || d.order_window < 1) goto bad_number;
+            break;
+        case 'd':
+            if (!str2u64(daemon_interval, optarg)) goto bad_number;
+            break;
         bad_number:
             printf("error: bad number '%s'.\n", optarg);
             goto show_help;
@@ -133,6 +207,43 @@ int main(int argc, char *argv[])
         case 10001: // no-dedup
             d.dedup_enable = false;
             break;
+        case 10002: // physical-order
+            d.physical_order = true;
+            break;
+        case 10003: // io-uring
+            KernelInterface::use_io_uring = true;
+            break;
+        case 10004: // drop-cache
+            KernelInterface::cache_mode = KernelInterface::CACHE_DROP;
+            break;
+        case 10005: // direct-io
+            KernelInterface::cache_mode = KernelInterface::CACHE_DIRECT;
+            break;
+        case 10006: // no-fiemap-sync
+            KernelInterface::fiemap_sync = false;
+            break;
+        case 10007: // btrfs-csum
+            d.btrfs_csum = true;
+            break;
+        case 10008: // whole-file
+            d.whole_file = true;
+            break;
+        case 10009: // punch-zero
+            d.punch_zero = true;
+            break;
+        case 10010: // in-place
+            d.inplace_source = true;
+            break;
+        case 10011: // relocate-all
+            d.relocate_all = true;
+            break;
+        case 10012: // submit-window
+            if (!str2u64(d.submit_window, optarg)) goto bad_number;
+            break;
+        case 10013: // dedup-threads
+            if (!str2u64(value, optarg) || value < 1 || value > 1024) goto bad_number;
+            d.dedup_threads = value;
+            break;
 
         default:
             printf("\n");
@@ -145,6 +256,12 @@ int main(int argc, char *argv[])
         }
     }
     
+    if (d.block_size == 0 || d.unit_size % d.block_size != 0) {
+        printf("error: unit size must be a multiple of block size.\n");
+        printf("\n");
+        return 1;
+    }
+
     if (isatty(0)) {
         printf("please pipe a NUL-delimited file list to me.\n");
         printf("use '--help' to get usage information.\n");
@@ -152,15 +269,16 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    // read file names
+    // read file names (or directories to watch in daemon mode)
     //   use 'find . -type f -print0' to create a file list
     int ch;
     std::string filename;
+    std::vector<std::string> names;
     while ((ch = getchar()) != EOF) {
         if (ch) {
             filename.push_back(ch);
         } else {
-            d.addFile(filename);
+            names.push_back(filename);
             filename.clear();
         }
     }
@@ -171,10 +289,29 @@ int main(int argc, char *argv[])
     }
 
     // set max opened file descriptors
-    KernelInterface::setMaxFD(d.ref_limit + 2500);
+    KernelInterface::setMaxFD((d.dedup_threads + 1) * d.ref_limit + 2500);
+    KernelInterface::initAsyncIO();
     LOG("\n");
-    
+
+    if (daemon_interval) {
+        // watch directories, dedup periodically
+        DedupDaemon daemon(d);
+        daemon.interval = daemon_interval;
+        if (!daemon.init()) {
+            return 1;
+        }
+        for (auto &name: names) {
+            daemon.addWatch(name);
+        }
+        daemon.run();
+        printf("\n");
+        return 0;
+    }
+
     // do dedup
+    for (auto &name: names) {
+        d.addFile(name);
+    }
     d.doDedup();
 
     printf("\n");
@@ -0,0 +1,89 @@
+#include "config.h"
+
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool(int _n_threads) : n_threads(_n_threads)
+{
+    max_queued = 4 * n_threads;
+    if (n_threads > 1) {
+        for (int i = 0; i < n_threads; i++) {
+            threads.emplace_back(&WorkerPool::workerMain, this, i);
+        }
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+        worker_cv.notify_all();
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+}
+
+bool WorkerPool::runnable(const Job &job)
+{
+    // mtx must be held
+    for (auto key: job.keys) {
+        if (busy_keys.find(key) != busy_keys.end()) return false;
+    }
+    return true;
+}
+
+void WorkerPool::workerMain(int worker)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    while (1) {
+        // earliest job not conflicting with running ones
+        auto it = queue.end();
+        worker_cv.wait(lock, [&]() {
+            it = std::find_if(queue.begin(), queue.end(), [&](const Job &job) { return runnable(job); });
+            return it != queue.end() || (stop && queue.empty());
+        });
+        if (it == queue.end()) return;
+
+        Job job = std::move(*it);
+        queue.erase(it);
+        busy_keys.insert(job.keys.begin(), job.keys.end());
+        running++;
+        submit_cv.notify_all();
+
+        lock.unlock();
+        job.func(worker);
+        lock.lock();
+
+        for (auto key: job.keys) {
+            busy_keys.erase(key);
+        }
+        running--;
+        worker_cv.notify_all();
+        submit_cv.notify_all();
+    }
+}
+
+void WorkerPool::submit(std::vector<uint64_t> keys, std::function<void(int worker)> func)
+{
+    if (threads.empty()) {
+        func(0);
+        return;
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    std::unique_lock<std::mutex> lock(mtx);
+    submit_cv.wait(lock, [&]() { return queue.size() < max_queued; });
+    Job job;
+    job.keys = std::move(keys);
+    job.func = std::move(func);
+    queue.push_back(std::move(job));
+    worker_cv.notify_all();
+}
+
+void WorkerPool::wait()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    submit_cv.wait(lock, [&]() { return queue.empty() && running == 0; });
+}
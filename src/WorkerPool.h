@@ -0,0 +1,41 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+// runs jobs on worker threads, jobs sharing a key (e.g. a file) never run at the same time
+//   with a single worker, jobs run on the calling thread in submission order
+class WorkerPool {
+    struct Job {
+        std::vector<uint64_t> keys;
+        std::function<void(int worker)> func;
+    };
+
+    int n_threads;
+
+    std::mutex mtx;
+    std::condition_variable worker_cv;
+    std::condition_variable submit_cv;
+
+    std::deque<Job> queue;
+    std::set<uint64_t> busy_keys;
+    size_t running = 0;
+    bool stop = false;
+    std::vector<std::thread> threads;
+
+    bool runnable(const Job &job);
+    void workerMain(int worker);
+
+public:
+    size_t max_queued; // submit() blocks when so many jobs are waiting
+
+    WorkerPool(int _n_threads);
+    ~WorkerPool();
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool& operator= (const WorkerPool &) = delete;
+
+    void submit(std::vector<uint64_t> keys, std::function<void(int worker)> func);
+    void wait(); // until all submitted jobs are finished
+};